@@ -0,0 +1,352 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bqueue.h"
+#include "harness.h"
+#include "random.h"
+
+/*
+ * Elements sit at physical indices 0 to size - 1; physical index p is slot
+ * (head + p) % BQ_BLOCK_SLOTS of block (head + p) / BQ_BLOCK_SLOTS, counted
+ * from map[first] around the circular map.  Only the blocks covering these
+ * slots are allocated.  When reversed is set, index i from the head is
+ * physical index size - 1 - i.
+ */
+struct bq_block {
+    char *slot[BQ_BLOCK_SLOTS];
+};
+
+struct bqueue {
+    struct bq_block **map;
+    size_t map_cap; /* Power of two */
+    size_t first;
+    size_t head;
+    size_t size;
+    bool reversed;
+};
+
+#define BQ_MAP_MIN 8
+
+/* Block holding slot k, counting slots from those of map[first] */
+static inline struct bq_block *block_at(const bqueue_t *q, size_t k)
+{
+    return q->map[(q->first + k / BQ_BLOCK_SLOTS) & (q->map_cap - 1)];
+}
+
+static inline char **slot_at(const bqueue_t *q, size_t p)
+{
+    size_t k = q->head + p;
+    return &block_at(q, k)->slot[k % BQ_BLOCK_SLOTS];
+}
+
+/* Physical index of the element at index i from the head */
+static inline size_t phys(const bqueue_t *q, size_t i)
+{
+    return q->reversed ? q->size - 1 - i : i;
+}
+
+static size_t block_count(const bqueue_t *q)
+{
+    return q->size ? (q->head + q->size - 1) / BQ_BLOCK_SLOTS + 1 : 0;
+}
+
+/* Make sure the map has room for one more block */
+static bool reserve_block(bqueue_t *q)
+{
+    size_t nb = block_count(q);
+    if (nb < q->map_cap)
+        return true;
+    struct bq_block **map = malloc(2 * q->map_cap * sizeof(*map));
+    if (!map)
+        return false;
+    for (size_t k = 0; k < nb; k++)
+        map[k] = q->map[(q->first + k) & (q->map_cap - 1)];
+    free(q->map);
+    q->map = map;
+    q->map_cap *= 2;
+    q->first = 0;
+    return true;
+}
+
+static bool push_back(bqueue_t *q, char *s)
+{
+    if (q->size == 0)
+        q->head = 0;
+    if (q->size == 0 || (q->head + q->size) % BQ_BLOCK_SLOTS == 0) {
+        if (!reserve_block(q))
+            return false;
+        struct bq_block *b = malloc(sizeof(*b));
+        if (!b)
+            return false;
+        q->map[(q->first + block_count(q)) & (q->map_cap - 1)] = b;
+    }
+    q->size++;
+    *slot_at(q, q->size - 1) = s;
+    return true;
+}
+
+static bool push_front(bqueue_t *q, char *s)
+{
+    if (q->size == 0 || q->head == 0) {
+        if (!reserve_block(q))
+            return false;
+        struct bq_block *b = malloc(sizeof(*b));
+        if (!b)
+            return false;
+        q->first = (q->first - 1) & (q->map_cap - 1);
+        q->map[q->first] = b;
+        q->head = BQ_BLOCK_SLOTS;
+    }
+    q->head--;
+    q->size++;
+    *slot_at(q, 0) = s;
+    return true;
+}
+
+static char *pop_front(bqueue_t *q)
+{
+    char *s = *slot_at(q, 0);
+    q->head++;
+    q->size--;
+    if (q->size == 0 || q->head == BQ_BLOCK_SLOTS) {
+        free(q->map[q->first]);
+        q->first = (q->first + 1) & (q->map_cap - 1);
+        q->head = 0;
+    }
+    return s;
+}
+
+static char *pop_back(bqueue_t *q)
+{
+    char *s = *slot_at(q, q->size - 1);
+    q->size--;
+    size_t end = q->head + q->size;
+    if (q->size == 0) {
+        free(q->map[q->first]);
+        q->head = 0;
+    } else if (end % BQ_BLOCK_SLOTS == 0) {
+        free(q->map[(q->first + end / BQ_BLOCK_SLOTS) & (q->map_cap - 1)]);
+    }
+    return s;
+}
+
+/* Move the strings of slots [lo, hi) up by one, a block at a time */
+static void move_up(bqueue_t *q, size_t lo, size_t hi)
+{
+    while (hi > lo) {
+        struct bq_block *b = block_at(q, hi);
+        size_t off = hi % BQ_BLOCK_SLOTS;
+        size_t n = off < hi - lo ? off : hi - lo;
+        memmove(&b->slot[off - n + 1], &b->slot[off - n], n * sizeof(char *));
+        hi -= n;
+        if (hi > lo) {
+            /* Slot 0 of b takes the last string of the previous block */
+            b->slot[0] = block_at(q, hi - 1)->slot[BQ_BLOCK_SLOTS - 1];
+            hi--;
+        }
+    }
+}
+
+/* Move the strings of slots (lo, hi] down by one, a block at a time */
+static void move_down(bqueue_t *q, size_t lo, size_t hi)
+{
+    while (lo < hi) {
+        struct bq_block *b = block_at(q, lo);
+        size_t off = lo % BQ_BLOCK_SLOTS;
+        size_t room = BQ_BLOCK_SLOTS - 1 - off;
+        size_t n = room < hi - lo ? room : hi - lo;
+        memmove(&b->slot[off], &b->slot[off + 1], n * sizeof(char *));
+        lo += n;
+        if (lo < hi) {
+            /* The last slot of b takes the first string of the next block */
+            b->slot[BQ_BLOCK_SLOTS - 1] = block_at(q, lo + 1)->slot[0];
+            lo++;
+        }
+    }
+}
+
+bqueue_t *bq_new(void)
+{
+    bqueue_t *q = malloc(sizeof(bqueue_t));
+    if (!q)
+        return NULL;
+    q->map = malloc(BQ_MAP_MIN * sizeof(*q->map));
+    if (!q->map) {
+        free(q);
+        return NULL;
+    }
+    q->map_cap = BQ_MAP_MIN;
+    q->first = 0;
+    q->head = 0;
+    q->size = 0;
+    q->reversed = false;
+    return q;
+}
+
+void bq_free(bqueue_t *q)
+{
+    if (!q)
+        return;
+    while (q->size)
+        free(pop_back(q));
+    free(q->map);
+    free(q);
+}
+
+static bool insert(bqueue_t *q, const char *s, bool at_head)
+{
+    if (!q)
+        return false;
+    char *copy = strdup(s);
+    if (!copy)
+        return false;
+    bool ok = at_head != q->reversed ? push_front(q, copy) : push_back(q, copy);
+    if (!ok)
+        free(copy);
+    return ok;
+}
+
+bool bq_insert_head(bqueue_t *q, const char *s)
+{
+    return insert(q, s, true);
+}
+
+bool bq_insert_tail(bqueue_t *q, const char *s)
+{
+    return insert(q, s, false);
+}
+
+static bool remove_end(bqueue_t *q, char *sp, size_t bufsize, bool at_head)
+{
+    if (!q || q->size == 0)
+        return false;
+    char *s = at_head != q->reversed ? pop_front(q) : pop_back(q);
+    if (sp && bufsize) {
+        strncpy(sp, s, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    free(s);
+    return true;
+}
+
+bool bq_remove_head(bqueue_t *q, char *sp, size_t bufsize)
+{
+    return remove_end(q, sp, bufsize, true);
+}
+
+bool bq_remove_tail(bqueue_t *q, char *sp, size_t bufsize)
+{
+    return remove_end(q, sp, bufsize, false);
+}
+
+size_t bq_blocks(const bqueue_t *q)
+{
+    /* The descriptor, the map, the blocks and a copy of every string */
+    return q ? 2 + block_count(q) + q->size : 0;
+}
+
+size_t bq_size(const bqueue_t *q)
+{
+    return q ? q->size : 0;
+}
+
+const char *bq_at(const bqueue_t *q, size_t i)
+{
+    return *slot_at(q, phys(q, i));
+}
+
+bool bq_delete_mid(bqueue_t *q)
+{
+    if (!q || q->size == 0)
+        return false;
+    size_t p = phys(q, (q->size - 1) / 2);
+    char *s = *slot_at(q, p);
+    /* Close the gap from the shorter side */
+    if (p < q->size - 1 - p) {
+        move_up(q, q->head, q->head + p);
+        pop_front(q);
+    } else {
+        move_down(q, q->head + p, q->head + q->size - 1);
+        pop_back(q);
+    }
+    free(s);
+    return true;
+}
+
+void bq_delete_dup(bqueue_t *q)
+{
+    if (!q)
+        return;
+    /* Equal strings are adjacent whichever way the queue is read */
+    size_t kept = 0;
+    for (size_t r = 0; r < q->size;) {
+        char *s = *slot_at(q, r);
+        size_t e = r + 1;
+        while (e < q->size && strcmp(*slot_at(q, e), s) == 0)
+            e++;
+        if (e - r == 1) {
+            *slot_at(q, kept++) = s;
+        } else {
+            for (size_t k = r; k < e; k++)
+                free(*slot_at(q, k));
+        }
+        r = e;
+    }
+    while (q->size > kept)
+        pop_back(q);
+}
+
+void bq_swap(bqueue_t *q)
+{
+    if (!q)
+        return;
+    for (size_t i = 0; i + 1 < q->size; i += 2) {
+        char **a = slot_at(q, phys(q, i));
+        char **b = slot_at(q, phys(q, i + 1));
+        char *tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+}
+
+void bq_reverse(bqueue_t *q)
+{
+    if (q)
+        q->reversed = !q->reversed;
+}
+
+static int value_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+bool bq_sort(bqueue_t *q)
+{
+    if (!q || q->size < 2)
+        return true;
+    char **values = malloc(q->size * sizeof(*values));
+    if (!values)
+        return false;
+    for (size_t p = 0; p < q->size; p++)
+        values[p] = *slot_at(q, p);
+    qsort(values, q->size, sizeof(*values), value_cmp);
+    for (size_t p = 0; p < q->size; p++)
+        *slot_at(q, p) = values[p];
+    free(values);
+    q->reversed = false;
+    return true;
+}
+
+void bq_shuffle(bqueue_t *q)
+{
+    if (!q)
+        return;
+    for (size_t p = q->size; p > 1; p--) {
+        char **a = slot_at(q, p - 1);
+        char **b = slot_at(q, prng_below(p));
+        char *tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+}
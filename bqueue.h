@@ -0,0 +1,95 @@
+#ifndef LAB0_BQUEUE_H
+#define LAB0_BQUEUE_H
+
+/*
+ * Queue of strings kept in a deque of fixed-size blocks.
+ *
+ * Each block holds BQ_BLOCK_SLOTS string pointers, and a circular map of
+ * block pointers lets the deque grow at both ends.  Any index is therefore
+ * reached by arithmetic instead of pointer chasing, and traversals read
+ * BQ_BLOCK_SLOTS elements per block, several per cache line.  Reversal only
+ * flips the direction in which indices are read.
+ *
+ * This is an alternative to the linked list of queue.h, exercised by the bq
+ * command of qtest.  The operations mirror their q_* counterparts; like
+ * queue.c, allocations go through harness.c.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BQ_BLOCK_SLOTS 64
+
+typedef struct bqueue bqueue_t;
+
+/*
+ * Create empty queue.
+ * Return NULL if could not allocate space.
+ */
+bqueue_t *bq_new(void);
+
+/* Free all storage used by queue.  No effect if q is NULL. */
+void bq_free(bqueue_t *q);
+
+/*
+ * Attempt to insert a copy of s at head or tail of queue.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool bq_insert_head(bqueue_t *q, const char *s);
+bool bq_insert_tail(bqueue_t *q, const char *s);
+
+/*
+ * Attempt to remove element from head or tail of queue.
+ * If sp is non-NULL, copy the removed string to *sp (up to a maximum of
+ * bufsize-1 characters, plus a null terminator.)
+ * Return false if q is NULL or empty.
+ */
+bool bq_remove_head(bqueue_t *q, char *sp, size_t bufsize);
+bool bq_remove_tail(bqueue_t *q, char *sp, size_t bufsize);
+
+/*
+ * Return the number of blocks allocated through harness.c that the queue
+ * holds, strings included, 0 if q is NULL
+ */
+size_t bq_blocks(const bqueue_t *q);
+
+/* Return number of elements in queue, 0 if q is NULL */
+size_t bq_size(const bqueue_t *q);
+
+/* Return the string at index i from the head, i < bq_size(q) */
+const char *bq_at(const bqueue_t *q, size_t i);
+
+/*
+ * Delete the element at index (size - 1) / 2, the one q_delete_mid()
+ * deletes from a list of the same size.  Finding it takes constant time;
+ * the shorter side of the deque then moves up by one slot.
+ * Return false if q is NULL or empty.
+ */
+bool bq_delete_mid(bqueue_t *q);
+
+/*
+ * Delete all elements whose string occurs more than once, in a queue
+ * sorted in ascending order.  No effect if q is NULL.
+ */
+void bq_delete_dup(bqueue_t *q);
+
+/* Swap every two adjacent elements.  No effect if q is NULL. */
+void bq_swap(bqueue_t *q);
+
+/* Reverse the elements in constant time.  No effect if q is NULL. */
+void bq_reverse(bqueue_t *q);
+
+/*
+ * Sort elements in ascending order.
+ * Return false if the scratch array could not be allocated, in which case
+ * the queue is left as is.
+ */
+bool bq_sort(bqueue_t *q);
+
+/*
+ * Put the elements in uniformly random order, drawn from the generator of
+ * random.h.  No effect if q is NULL.
+ */
+void bq_shuffle(bqueue_t *q);
+
+#endif /* LAB0_BQUEUE_H */
@@ -10,13 +10,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "dudect/cpucycles.h"
 #include "report.h"
 
+/* Read allocation counters of the harness, with regular malloc/free kept */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
@@ -34,6 +41,10 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ *
+ * Regular files are mapped into memory instead, and the mapping takes the
+ * place of the internal buffer: bufptr and cnt then walk the whole file,
+ * and no read() is ever needed.
  */
 
 #define RIO_BUFSIZE 8192
@@ -41,8 +52,10 @@ typedef struct RIO_ELE rio_t, *rio_ptr;
 
 struct RIO_ELE {
     int fd;                /* File descriptor */
-    int cnt;               /* Unread bytes in internal buffer */
+    size_t cnt;            /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
+    char *map;             /* Mapping of the file, or NULL */
+    size_t map_len;        /* Length of the mapping */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
     rio_ptr prev;          /* Next element in stack */
 };
@@ -50,6 +63,73 @@ struct RIO_ELE {
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Words of the command line being interpreted, pointing into linebuf */
+#define MAXARGS (RIO_BUFSIZE / 2)
+static char *argv_buf[MAXARGS];
+
+/*
+ * Binary traces written by the record command and run by replay.
+ *
+ * After an 8-byte header, a trace is a sequence of entries, each starting
+ * with a tag byte; all integers are unsigned LEB128:
+ *   TRACE_STRING len bytes      defines the next string ID, counting from 0
+ *   TRACE_CMD count argc id...  runs the command line made of strings id...
+ *                               count times in a row
+ * Strings are interned, so each distinct word is stored once, and runs of
+ * identical command lines collapse into a single record.
+ */
+#define TRACE_MAGIC "QTRACE\0\1"
+#define TRACE_STRING 1
+#define TRACE_CMD 2
+
+typedef struct {
+    char *str;
+    uint32_t id;
+} trace_slot_t;
+
+static struct {
+    FILE *fp;
+    trace_slot_t *slots; /* Open addressing table of interned strings */
+    uint32_t cap;
+    uint32_t nstr;
+    /* Pending command line, written once a different one comes along */
+    uint64_t count;
+    int argc;
+    uint32_t ids[MAXARGS];
+} rec;
+
+/* Commands running, one inside the other, apart from replay */
+static int cmd_depth = 0;
+
+/* Set while interpret_session_cmd() runs a command line */
+static bool in_session = false;
+static bool session_files = false;
+
+/*
+ * Lookup tables over cmd_list and param_list: open addressing hash tables
+ * for finding an entry by name, and arrays in alphabetical order for prefix
+ * completion.  They are rebuilt on the first lookup after add_cmd() or
+ * add_param(), so in practice once, when initialization is over.
+ */
+static struct {
+    bool stale;
+    cmd_ptr *cmds;
+    size_t cmd_cap;
+    char **cmd_names;
+    size_t ncmd;
+    param_ptr *params;
+    size_t param_cap;
+    char **param_names;
+    size_t nparam;
+} lookup = {.stale = true};
+
+static bool do_quit(int argc, char *argv[]);
+static bool do_source(int argc, char *argv[]);
+static bool do_record(int argc, char *argv[]);
+static bool do_replay(int argc, char *argv[]);
+static void record_cmd(int argc, char *argv[]);
+static void record_stop();
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -62,6 +142,28 @@ static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
+/*
+ * Per-command profile, collected for every dispatched command while option
+ * profile is set.  Latencies go in a log2 histogram: bucket i counts the
+ * calls that took [2^i, 2^(i+1)) nanoseconds.
+ */
+static int profile = 0;
+
+#define PROF_BUCKETS 40
+
+struct cmd_profile {
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t max_ns;
+    uint64_t cycles;
+    uint64_t hist[PROF_BUCKETS];
+    size_t malloc_cnt;
+    size_t free_cnt;
+    size_t malloc_bytes;
+    size_t free_bytes;
+    size_t peak_blocks;
+};
+
 /* Optional function to call as part of exit process */
 /* Maximum number of quit functions */
 
@@ -76,8 +178,19 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+static uint32_t str_hash(const char *s)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 16777619u;
+    return h;
+}
+
 /* Add a new command */
-void add_cmd(char *name, cmd_function operation, char *documentation)
+static cmd_ptr new_cmd(char *name,
+                       cmd_function operation,
+                       char *documentation)
 {
     cmd_ptr next_cmd = cmd_list;
     cmd_ptr *last_loc = &cmd_list;
@@ -90,8 +203,23 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->prof = NULL;
+    ele->files = false;
     ele->next = next_cmd;
     *last_loc = ele;
+    lookup.stale = true;
+    return ele;
+}
+
+void add_cmd(char *name, cmd_function operation, char *documentation)
+{
+    new_cmd(name, operation, documentation);
+}
+
+/* Add a new command that reads or writes files named by its arguments */
+void add_file_cmd(char *name, cmd_function operation, char *documentation)
+{
+    new_cmd(name, operation, documentation)->files = true;
 }
 
 /* Add a new parameter */
@@ -114,52 +242,105 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+    lookup.stale = true;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+static void lookup_free()
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
-    int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
+    if (lookup.cmds) {
+        free_array(lookup.cmds, lookup.cmd_cap, sizeof(cmd_ptr));
+        free_array(lookup.cmd_names, lookup.ncmd + 1, sizeof(char *));
+        free_array(lookup.params, lookup.param_cap, sizeof(param_ptr));
+        free_array(lookup.param_names, lookup.nparam + 1, sizeof(char *));
+    }
+    memset(&lookup, 0, sizeof(lookup));
+    lookup.stale = true;
+}
+
+/* Smallest power of two holding n entries at a load factor of 1/2 */
+static size_t table_cap(size_t n)
+{
+    size_t cap = 16;
+    while (cap < 2 * n)
+        cap <<= 1;
+    return cap;
+}
+
+static void lookup_build()
+{
+    lookup_free();
+    for (cmd_ptr c = cmd_list; c; c = c->next)
+        lookup.ncmd++;
+    for (param_ptr p = param_list; p; p = p->next)
+        lookup.nparam++;
+
+    lookup.cmd_cap = table_cap(lookup.ncmd);
+    lookup.cmds = calloc_or_fail(lookup.cmd_cap, sizeof(cmd_ptr), "lookup");
+    lookup.cmd_names =
+        calloc_or_fail(lookup.ncmd + 1, sizeof(char *), "lookup");
+    size_t n = 0;
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        size_t i = str_hash(c->name) & (lookup.cmd_cap - 1);
+        while (lookup.cmds[i])
+            i = (i + 1) & (lookup.cmd_cap - 1);
+        lookup.cmds[i] = c;
+        /* The lists are kept in alphabetical order already */
+        lookup.cmd_names[n++] = c->name;
+    }
+
+    lookup.param_cap = table_cap(lookup.nparam);
+    lookup.params =
+        calloc_or_fail(lookup.param_cap, sizeof(param_ptr), "lookup");
+    lookup.param_names =
+        calloc_or_fail(lookup.nparam + 1, sizeof(char *), "lookup");
+    n = 0;
+    for (param_ptr p = param_list; p; p = p->next) {
+        size_t i = str_hash(p->name) & (lookup.param_cap - 1);
+        while (lookup.params[i])
+            i = (i + 1) & (lookup.param_cap - 1);
+        lookup.params[i] = p;
+        lookup.param_names[n++] = p->name;
     }
+    lookup.stale = false;
+}
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+static param_ptr find_param(const char *name)
+{
+    if (lookup.stale)
+        lookup_build();
+    for (size_t i = str_hash(name) & (lookup.param_cap - 1); lookup.params[i];
+         i = (i + 1) & (lookup.param_cap - 1)) {
+        if (strcmp(lookup.params[i]->name, name) == 0)
+            return lookup.params[i];
+    }
+    return NULL;
+}
+
+/*
+ * Parse a string into a command line.
+ * The string is split in place: white space after each word is replaced
+ * by a null character, and the returned array points into the string.
+ * The array is only valid until the next call.
+ */
+static char **parse_args(char *line, int *argcp)
+{
+    int argc = 0;
+    char *p = line;
+    for (;;) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0' || argc == MAXARGS)
+            break;
+        argv_buf[argc++] = p;
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        *p++ = '\0';
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return argv_buf;
 }
 
 static void record_error()
@@ -171,20 +352,123 @@ static void record_error()
     }
 }
 
+static uint64_t ns_between(const struct timespec *t0, const struct timespec *t1)
+{
+    return (uint64_t) (t1->tv_sec - t0->tv_sec) * 1000000000 +
+           (uint64_t) t1->tv_nsec - (uint64_t) t0->tv_nsec;
+}
+
+/* Run a command and add its latency and allocations to its profile */
+static bool profile_cmd(cmd_ptr cmd, int argc, char *argv[])
+{
+    alloc_stats_t before, after;
+    struct timespec t0, t1;
+
+    allocation_stats(&before);
+    allocation_reset_peak();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int64_t c0 = cpucycles();
+    bool ok = cmd->operation(argc, argv);
+    int64_t c1 = cpucycles();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    allocation_stats(&after);
+
+    /* The quit command has released the command list */
+    if (quit_flag)
+        return ok;
+
+    if (!cmd->prof)
+        cmd->prof = calloc_or_fail(1, sizeof(struct cmd_profile), "profile");
+    struct cmd_profile *p = cmd->prof;
+    uint64_t ns = ns_between(&t0, &t1);
+    int b = 0;
+    while (b < PROF_BUCKETS - 1 && (ns >> (b + 1)))
+        b++;
+    p->calls++;
+    p->ns += ns;
+    p->cycles += c1 - c0;
+    p->hist[b]++;
+    if (ns > p->max_ns)
+        p->max_ns = ns;
+    p->malloc_cnt += after.malloc_cnt - before.malloc_cnt;
+    p->free_cnt += after.free_cnt - before.free_cnt;
+    p->malloc_bytes += after.malloc_bytes - before.malloc_bytes;
+    p->free_bytes += after.free_bytes - before.free_bytes;
+    if (after.peak_blocks > p->peak_blocks)
+        p->peak_blocks = after.peak_blocks;
+    return ok;
+}
+
+/* Whether a session may run cmd, reporting why not */
+static bool session_allows(cmd_ptr cmd)
+{
+    /* These act on the whole program rather than on the session */
+    if (cmd->operation == do_quit || cmd->operation == do_source) {
+        report(1, "Command '%s' is not available in a session", cmd->name);
+        return false;
+    }
+    if (cmd->files && !session_files) {
+        report(1, "Command '%s' may not open files in a session", cmd->name);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Run a command, recording and profiling it as requested.
+ * Only top-level commands are recorded: the one run by time is part of the
+ * time command line.  The lines of a replayed trace or a sourced file are
+ * recorded in place of the replay and source commands, so that the trace
+ * runs them in the order they ran.  Within a session, commands that
+ * session_allows() refuses do not run at all.
+ */
+static bool run_cmd(cmd_ptr cmd, int argc, char *argv[])
+{
+    if (in_session && !session_allows(cmd))
+        return false;
+    if (rec.fp && cmd_depth == 0 && cmd->operation != do_record &&
+        cmd->operation != do_replay && cmd->operation != do_source)
+        record_cmd(argc, argv);
+    /* Replayed commands run as if read one by one */
+    bool nested = cmd->operation != do_replay;
+    cmd_depth += nested;
+    bool ok =
+        profile ? profile_cmd(cmd, argc, argv) : cmd->operation(argc, argv);
+    cmd_depth -= nested;
+    return ok;
+}
+
+/* Run a command found in the command list */
+static bool dispatch(cmd_ptr cmd, int argc, char *argv[])
+{
+    bool ok = run_cmd(cmd, argc, argv);
+    if (!ok)
+        record_error();
+    return ok;
+}
+
+static cmd_ptr find_cmd(const char *name)
+{
+    if (lookup.stale)
+        lookup_build();
+    for (size_t i = str_hash(name) & (lookup.cmd_cap - 1); lookup.cmds[i];
+         i = (i + 1) & (lookup.cmd_cap - 1)) {
+        if (strcmp(lookup.cmds[i]->name, name) == 0)
+            return lookup.cmds[i];
+    }
+    return NULL;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
-        if (!ok)
-            record_error();
+        ok = dispatch(next_cmd, argc, argv);
     } else {
         report(1, "Unknown command '%s'", argv[0]);
         record_error();
@@ -203,16 +487,46 @@ static bool interpret_cmd(char *cmdline)
 #if RPT >= 6
     report(6, "Interpreting command '%s'\n", cmdline);
 #endif
+    /* Lines from linenoise are kept for the history, so split a copy */
+    if (cmdline != linebuf) {
+        size_t len = strnlen(cmdline, RIO_BUFSIZE - 1);
+        memcpy(linebuf, cmdline, len);
+        linebuf[len] = '\0';
+    }
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char **argv = parse_args(linebuf, &argc);
+    return interpret_cmda(argc, argv);
+}
 
+bool interpret_session_cmd(char *cmdline)
+{
+    if (quit_flag)
+        return false;
+
+    size_t len = strnlen(cmdline, RIO_BUFSIZE - 1);
+    memcpy(linebuf, cmdline, len);
+    linebuf[len] = '\0';
+    int argc;
+    char **argv = parse_args(linebuf, &argc);
+    if (argc == 0)
+        return true;
+
+    cmd_ptr cmd = find_cmd(argv[0]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[0]);
+        return false;
+    }
+    in_session = true;
+    bool ok = run_cmd(cmd, argc, argv);
+    in_session = false;
     return ok;
 }
 
+void set_session_files(bool allow)
+{
+    session_files = allow;
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf)
 {
@@ -233,9 +547,13 @@ static bool do_quit(int argc, char *argv[])
 {
     cmd_ptr c = cmd_list;
     bool ok = true;
+    record_stop();
+    lookup_free();
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->prof)
+            free_block(ele->prof, sizeof(struct cmd_profile));
         free_block(ele, sizeof(cmd_ele));
     }
 
@@ -326,17 +644,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter in table */
+        param_ptr plist = find_param(name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -397,6 +712,359 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/*
+ * Upper bound of the histogram bucket holding fraction q of the calls,
+ * capped by the largest latency seen
+ */
+static uint64_t prof_quantile(const struct cmd_profile *p, double q)
+{
+    uint64_t seen = 0;
+    for (int b = 0; b < PROF_BUCKETS - 1; b++) {
+        seen += p->hist[b];
+        if (seen >= q * p->calls) {
+            uint64_t bound = (uint64_t) 1 << (b + 1);
+            return bound < p->max_ns ? bound : p->max_ns;
+        }
+    }
+    return p->max_ns;
+}
+
+static void stats_json()
+{
+    size_t cur_bytes, peak_bytes;
+    mem_usage(&cur_bytes, &peak_bytes);
+    report(1, "{\"commands\": [");
+    bool first = true;
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        struct cmd_profile *p = c->prof;
+        if (!p || !p->calls)
+            continue;
+        int top = PROF_BUCKETS;
+        while (top > 0 && !p->hist[top - 1])
+            top--;
+        report_noreturn(1,
+                        "%s {\"name\": \"%s\", \"calls\": %" PRIu64
+                        ", \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64
+                        ", \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+                        ", \"cycles\": %" PRIu64,
+                        first ? "" : ",\n", c->name, p->calls, p->ns,
+                        p->max_ns, prof_quantile(p, 0.5),
+                        prof_quantile(p, 0.99), p->cycles);
+        report_noreturn(1,
+                        ", \"mallocs\": %zu, \"frees\": %zu, "
+                        "\"malloc_bytes\": %zu, \"free_bytes\": %zu, "
+                        "\"peak_blocks\": %zu, \"hist\": [",
+                        p->malloc_cnt, p->free_cnt, p->malloc_bytes,
+                        p->free_bytes, p->peak_blocks);
+        for (int b = 0; b < top; b++)
+            report_noreturn(1, "%s%" PRIu64, b ? ", " : "", p->hist[b]);
+        report_noreturn(1, "]}");
+        first = false;
+    }
+    report(1, "%s], \"interp_bytes\": %zu, \"interp_peak_bytes\": %zu}",
+           first ? "" : "\n", cur_bytes, peak_bytes);
+}
+
+static void stats_table()
+{
+    size_t cur_bytes, peak_bytes;
+    mem_usage(&cur_bytes, &peak_bytes);
+    report(1, "%-10s %9s %10s %9s %9s %9s %10s %9s %8s %8s %10s %8s", "Command",
+           "Calls", "Total ms", "Avg ns", "p50 ns", "p99 ns", "Max ns",
+           "Cyc/call", "Mall/c", "Free/c", "Bytes/c", "Peak blk");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        struct cmd_profile *p = c->prof;
+        if (!p || !p->calls)
+            continue;
+        report(1,
+               "%-10s %9" PRIu64 " %10.3f %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+               " %10" PRIu64 " %9" PRIu64 " %8.2f %8.2f %10.1f %8zu",
+               c->name, p->calls, p->ns / 1e6, p->ns / p->calls,
+               prof_quantile(p, 0.5), prof_quantile(p, 0.99), p->max_ns,
+               p->cycles / p->calls, (double) p->malloc_cnt / p->calls,
+               (double) p->free_cnt / p->calls,
+               (double) p->malloc_bytes / p->calls, p->peak_blocks);
+    }
+    report(1, "Interpreter memory: %zu bytes, peak %zu bytes", cur_bytes,
+           peak_bytes);
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+
+    if (argc == 1) {
+        stats_table();
+    } else if (strcmp(argv[1], "json") == 0) {
+        stats_json();
+    } else if (strcmp(argv[1], "reset") == 0) {
+        for (cmd_ptr c = cmd_list; c; c = c->next) {
+            if (c->prof)
+                memset(c->prof, 0, sizeof(struct cmd_profile));
+        }
+    } else {
+        report(1, "Unknown argument '%s' to %s", argv[1], argv[0]);
+        return false;
+    }
+
+    if (!profile)
+        report(2, "Warning: profiling is off, use 'option profile 1'");
+    return true;
+}
+
+static void put_uleb(uint64_t v)
+{
+    do {
+        unsigned char b = v & 0x7f;
+        v >>= 7;
+        putc(v ? b | 0x80 : b, rec.fp);
+    } while (v);
+}
+
+/* Return the ID of s, writing its definition the first time it is seen */
+static uint32_t intern(const char *s)
+{
+    if (2 * (rec.nstr + 1) > rec.cap) {
+        uint32_t cap = rec.cap ? 2 * rec.cap : 256;
+        trace_slot_t *slots =
+            calloc_or_fail(cap, sizeof(trace_slot_t), "intern");
+        for (uint32_t i = 0; i < rec.cap; i++) {
+            if (!rec.slots[i].str)
+                continue;
+            uint32_t j = str_hash(rec.slots[i].str) & (cap - 1);
+            while (slots[j].str)
+                j = (j + 1) & (cap - 1);
+            slots[j] = rec.slots[i];
+        }
+        if (rec.slots)
+            free_array(rec.slots, rec.cap, sizeof(trace_slot_t));
+        rec.slots = slots;
+        rec.cap = cap;
+    }
+
+    uint32_t i = str_hash(s) & (rec.cap - 1);
+    for (; rec.slots[i].str; i = (i + 1) & (rec.cap - 1)) {
+        if (strcmp(rec.slots[i].str, s) == 0)
+            return rec.slots[i].id;
+    }
+    size_t len = strlen(s);
+    rec.slots[i].str = strsave_or_fail((char *) s, "intern");
+    rec.slots[i].id = rec.nstr++;
+    putc(TRACE_STRING, rec.fp);
+    put_uleb(len);
+    fwrite(s, 1, len, rec.fp);
+    return rec.slots[i].id;
+}
+
+static void record_flush()
+{
+    if (!rec.count)
+        return;
+    putc(TRACE_CMD, rec.fp);
+    put_uleb(rec.count);
+    put_uleb(rec.argc);
+    for (int i = 0; i < rec.argc; i++)
+        put_uleb(rec.ids[i]);
+    rec.count = 0;
+}
+
+/* Append a command line to the trace being recorded */
+static void record_cmd(int argc, char *argv[])
+{
+    uint32_t ids[MAXARGS];
+    for (int i = 0; i < argc; i++)
+        ids[i] = intern(argv[i]);
+    if (rec.count && argc == rec.argc &&
+        memcmp(ids, rec.ids, argc * sizeof(uint32_t)) == 0) {
+        rec.count++;
+        return;
+    }
+    record_flush();
+    memcpy(rec.ids, ids, argc * sizeof(uint32_t));
+    rec.argc = argc;
+    rec.count = 1;
+}
+
+/* Finish the trace being recorded, if any */
+static void record_stop()
+{
+    if (!rec.fp)
+        return;
+    record_flush();
+    fclose(rec.fp);
+    rec.fp = NULL;
+    for (uint32_t i = 0; i < rec.cap; i++) {
+        if (rec.slots[i].str)
+            free_string(rec.slots[i].str);
+    }
+    if (rec.slots)
+        free_array(rec.slots, rec.cap, sizeof(trace_slot_t));
+    rec.slots = NULL;
+    rec.cap = rec.nstr = 0;
+}
+
+static bool do_record(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+
+    record_stop();
+    if (argc == 1)
+        return true;
+
+    rec.fp = fopen(argv[1], "wb");
+    if (!rec.fp) {
+        report(1, "Couldn't open trace file '%s'", argv[1]);
+        return false;
+    }
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, rec.fp);
+    return true;
+}
+
+/* Decoded trace: records refer to the strings of one shared buffer */
+typedef struct {
+    cmd_ptr cmd;
+    uint64_t count;
+    int argc;
+    char **argv;
+} trace_rec_t;
+
+static bool get_uleb(const unsigned char **pp,
+                     const unsigned char *end,
+                     uint64_t *v)
+{
+    uint64_t r = 0;
+    for (int shift = 0; *pp < end && shift < 64; shift += 7) {
+        unsigned char b = *(*pp)++;
+        r |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Run a binary trace.  The whole file is decoded first: strings are copied
+ * out once, and each record gets its command looked up and its argument
+ * vector built, so running a record is a direct call of the command.
+ */
+static bool do_replay(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes one argument", argv[0]);
+        return false;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        report(1, "Couldn't open trace file '%s'", argv[1]);
+        return false;
+    }
+    size_t len = st.st_size;
+    void *map = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED || len < sizeof(TRACE_MAGIC) - 1 ||
+        memcmp(map, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0) {
+        if (map && map != MAP_FAILED)
+            munmap(map, len);
+        report(1, "'%s' is not a trace file", argv[1]);
+        return false;
+    }
+
+    /*
+     * First pass only counts, so that everything is allocated at once.
+     * A string takes its length plus a null character and a command line
+     * takes argc pointers, so len bounds both buffers.
+     */
+    const unsigned char *start = (const unsigned char *) map;
+    const unsigned char *end = start + len;
+    const unsigned char *p;
+    size_t nstr = 0, nrec = 0, nwords = 0;
+    uint64_t v, n, c;
+    bool ok = true;
+    for (p = start + sizeof(TRACE_MAGIC) - 1; ok && p < end;) {
+        unsigned char tag = *p++;
+        if (tag == TRACE_STRING) {
+            ok = get_uleb(&p, end, &v) && v <= (uint64_t) (end - p);
+            p += ok ? v : 0;
+            nstr++;
+        } else if (tag == TRACE_CMD) {
+            ok = get_uleb(&p, end, &c) && get_uleb(&p, end, &n) &&
+                 n <= MAXARGS;
+            for (uint64_t i = 0; ok && i < n; i++)
+                ok = get_uleb(&p, end, &v) && v < nstr;
+            nrec++;
+            nwords += n;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        munmap(map, len);
+        report(1, "Corrupted trace file '%s'", argv[1]);
+        return false;
+    }
+
+    char *strbuf = malloc_or_fail(len + 1, "replay");
+    char **strs = calloc_or_fail(nstr + 1, sizeof(char *), "replay");
+    char **words = calloc_or_fail(nwords + 1, sizeof(char *), "replay");
+    trace_rec_t *recs = calloc_or_fail(nrec + 1, sizeof(trace_rec_t), "replay");
+    char *sp = strbuf, **wp = words;
+    size_t si = 0, ri = 0;
+    for (p = start + sizeof(TRACE_MAGIC) - 1; p < end;) {
+        if (*p++ == TRACE_STRING) {
+            get_uleb(&p, end, &v);
+            memcpy(sp, p, v);
+            sp[v] = '\0';
+            strs[si++] = sp;
+            sp += v + 1;
+            p += v;
+            continue;
+        }
+        trace_rec_t *r = &recs[ri++];
+        get_uleb(&p, end, &r->count);
+        get_uleb(&p, end, &n);
+        r->argc = n;
+        r->argv = wp;
+        for (uint64_t i = 0; i < n; i++) {
+            get_uleb(&p, end, &v);
+            *wp++ = strs[v];
+        }
+        r->cmd = n ? find_cmd(r->argv[0]) : NULL;
+    }
+    munmap(map, len);
+
+    for (size_t i = 0; i < nrec && !quit_flag; i++) {
+        trace_rec_t *r = &recs[i];
+        if (r->argc == 0)
+            continue;
+        if (!r->cmd) {
+            report(1, "Unknown command '%s'", r->argv[0]);
+            record_error();
+            ok = false;
+            continue;
+        }
+        for (uint64_t k = 0; k < r->count && !quit_flag; k++)
+            ok = dispatch(r->cmd, r->argc, r->argv) && ok;
+    }
+
+    free_array(recs, nrec + 1, sizeof(trace_rec_t));
+    free_array(words, nwords + 1, sizeof(char *));
+    free_array(strs, nstr + 1, sizeof(char *));
+    free_block(strbuf, len + 1);
+    return ok;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
@@ -409,13 +1077,21 @@ void init_cmd()
     ADD_COMMAND(option, " [name val]     | Display or set options");
     ADD_COMMAND(quit, "                | Exit program");
     ADD_COMMAND(source, " file           | Read commands from source file");
-    ADD_COMMAND(log, " file           | Copy output to file");
+    ADD_FILE_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(stats,
+                " [json|reset]   | Show or clear per-command profile");
+    ADD_FILE_COMMAND(
+        record, " [file]         | Record commands to binary trace, or stop");
+    ADD_FILE_COMMAND(replay,
+                     " file           | Run commands from binary trace");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("profile", &profile,
+              "Collect per-command latency and allocations", NULL);
 
     init_in();
     init_time(&last_time);
@@ -440,7 +1116,21 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
     rnew->prev = buf_stack;
+
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+            rnew->bufptr = map;
+            rnew->cnt = st.st_size;
+        }
+    }
     buf_stack = rnew;
 
     return true;
@@ -452,6 +1142,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -463,51 +1155,58 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/* Refill the internal buffer; return false at EOF */
+static bool rio_fill(rio_ptr rp)
+{
+    if (rp->map)
+        return false;
+    ssize_t n = read(rp->fd, rp->buf, RIO_BUFSIZE);
+    if (n <= 0)
+        return false;
+    rp->bufptr = rp->buf;
+    rp->cnt = n;
+    return true;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
 static char *readline()
 {
-    int cnt;
-    char c;
     char *lptr = linebuf;
+    /* Leave room for an added newline and the null character */
+    size_t room = RIO_BUFSIZE - 2;
+    bool eol = false;
 
     if (!buf_stack)
         return NULL;
 
-    for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->cnt <= 0) {
-            /* Need to read from input file */
-            buf_stack->cnt = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->cnt <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
+    while (!eol && room > 0) {
+        if (buf_stack->cnt == 0 && !rio_fill(buf_stack)) {
+            /* Encountered EOF */
+            pop_file();
+            if (lptr == linebuf)
                 return NULL;
-            }
+            /* Last line of file did not terminate with newline. */
+            break;
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->cnt--;
-        if (c == '\n')
-            break;
+        /* Have text in buffer; copy up to and including the newline */
+        size_t n = buf_stack->cnt < room ? buf_stack->cnt : room;
+        char *nl = memchr(buf_stack->bufptr, '\n', n);
+        if (nl) {
+            n = nl - buf_stack->bufptr + 1;
+            eol = true;
+        }
+        memcpy(lptr, buf_stack->bufptr, n);
+        lptr += n;
+        buf_stack->bufptr += n;
+        buf_stack->cnt -= n;
+        room -= n;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
+    if (!eol) {
+        /* Hit buffer limit or EOF.  Artificially terminate line */
         *lptr++ = '\n';
     }
     *lptr++ = '\0';
@@ -547,6 +1246,17 @@ int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /*
+     * Input already buffered, which includes all of a mapped file, can be
+     * interpreted right away when there is nothing else to wait for.
+     */
+    if (!block_flag && has_infile && nfds == 0 && buf_stack->cnt > 0) {
+        char *cmdline = readline();
+        if (cmdline)
+            interpret_cmd(cmdline);
+        return 0;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -595,44 +1305,52 @@ bool finish_cmd()
     return ok && err_cnt == 0;
 }
 
-static bool cmd_maybe(const char *target, const char *src)
+/*
+ * Index of the first of n names, in alphabetical order, that is not less
+ * than prefix; names starting with prefix follow it contiguously.
+ */
+static size_t lower_bound(char **names, size_t n, const char *prefix)
 {
-    for (int i = 0; i < strlen(src); i++) {
-        if (target[i] == '\0')
-            return false;
-        if (src[i] != target[i])
-            return false;
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(names[mid], prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return true;
+    return lo;
 }
 
 void completion(const char *buf, linenoiseCompletions *lc)
 {
-    if (strncmp("option ", buf, 7) == 0) {
-        param_ptr plist = param_list;
+    if (lookup.stale)
+        lookup_build();
 
-        while (plist) {
-            char str[128] = "";
+    if (strncmp("option ", buf, 7) == 0) {
+        const char *prefix = buf + 7;
+        size_t len = strlen(prefix);
+        for (size_t i = lower_bound(lookup.param_names, lookup.nparam, prefix);
+             i < lookup.nparam; i++) {
+            const char *name = lookup.param_names[i];
+            char str[128] = "option ";
+            if (strncmp(name, prefix, len) != 0)
+                break;
             // if parameter is too long, now we just ignore it
-            if (strlen(plist->name) > 120)
+            if (strlen(name) > 120)
                 continue;
-
-            strcat(str, "option ");
-            strcat(str, plist->name);
-            if (cmd_maybe(str, buf))
-                linenoiseAddCompletion(lc, str);
-
-            plist = plist->next;
+            strcat(str, name);
+            linenoiseAddCompletion(lc, str);
         }
         return;
     }
 
-    cmd_ptr clist = cmd_list;
-    while (clist) {
-        if (cmd_maybe(clist->name, buf))
-            linenoiseAddCompletion(lc, clist->name);
-
-        clist = clist->next;
+    size_t len = strlen(buf);
+    for (size_t i = lower_bound(lookup.cmd_names, lookup.ncmd, buf);
+         i < lookup.ncmd; i++) {
+        if (strncmp(lookup.cmd_names[i], buf, len) != 0)
+            break;
+        linenoiseAddCompletion(lc, lookup.cmd_names[i]);
     }
 }
 
@@ -21,6 +21,10 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    /* Statistics gathered while option profile is set, NULL until then */
+    struct cmd_profile *prof;
+    /* Opens files named by its arguments, see interpret_session_cmd() */
+    bool files;
     cmd_ptr next;
 };
 
@@ -45,6 +49,10 @@ void init_cmd();
 void add_cmd(char *name, cmd_function operation, char *documentation);
 #define ADD_COMMAND(cmd, msg) add_cmd(#cmd, do_##cmd, msg)
 
+/* Add a new command that reads or writes files named by its arguments */
+void add_file_cmd(char *name, cmd_function operation, char *documentation);
+#define ADD_FILE_COMMAND(cmd, msg) add_file_cmd(#cmd, do_##cmd, msg)
+
 /* Add a new parameter */
 void add_param(char *name,
                int *valp,
@@ -79,6 +87,20 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/*
+ * Run a single command line on behalf of a server session.
+ * Unlike commands read by run_console(), a failure does not count toward
+ * the error limit, and commands acting on the whole program, such as quit
+ * and source, are refused.  So are commands added with add_file_cmd(),
+ * unless set_session_files() allowed them, as a client should not reach
+ * the files of the server.  The checks cover commands run by time too.
+ * Return true if the command succeeded.
+ */
+bool interpret_session_cmd(char *cmdline);
+
+/* Let commands run by interpret_session_cmd() open files, or not */
+void set_session_files(bool allow);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
@@ -0,0 +1,367 @@
+/* Concurrent queues: two-lock and lock-free Michael-Scott variants */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+
+/*
+ * Both variants share the layout of the Michael-Scott queue: a singly-linked
+ * list that always starts with a dummy node.  head points to the dummy, and
+ * the first real element is head->next.  Removing an element turns its node
+ * into the new dummy and releases the old one.
+ *
+ * Reference: M. M. Michael and M. L. Scott, "Simple, Fast, and Practical
+ * Non-Blocking and Blocking Concurrent Queue Algorithms", PODC 1996.
+ */
+
+/* Hazard pointers needed by each thread of the lock-free variant */
+#define HP_PER_THREAD 2
+
+/* Number of retired nodes a thread collects before trying to free them */
+#define HP_SCAN_THRESHOLD 64
+
+struct cq_node {
+    _Atomic(struct cq_node *) next;
+    char *value;
+    /* Link in the retired list of the thread that removed the node */
+    struct cq_node *retired_next;
+};
+
+/*
+ * Hazard pointer record.
+ * A thread publishes in hp[] the nodes it is about to dereference; retired
+ * nodes are only freed once no record holds them.  Records are created on
+ * the first operation of a thread and are owned by it until cq_free().
+ */
+struct hp_rec {
+    _Atomic(struct cq_node *) hp[HP_PER_THREAD];
+    pthread_t owner;
+    struct hp_rec *next;
+    struct cq_node *retired;
+    size_t nretired;
+};
+
+struct cqueue {
+    cq_kind_t kind;
+    unsigned long id;
+    _Atomic(struct cq_node *) head;
+    _Atomic(struct cq_node *) tail;
+    /* CQ_TWO_LOCK only */
+    pthread_mutex_t head_lock;
+    pthread_mutex_t tail_lock;
+    /* CQ_LOCK_FREE only */
+    _Atomic(struct hp_rec *) recs;
+    pthread_mutex_t recs_lock;
+};
+
+/* Distinguishes queues that happen to be allocated at the same address */
+static atomic_ulong cq_next_id = 1;
+
+/* Record of the calling thread for the queue it used last */
+static __thread struct {
+    unsigned long id;
+    struct hp_rec *rec;
+} hp_cache;
+
+static struct cq_node *node_new(char *value)
+{
+    struct cq_node *n = malloc(sizeof(struct cq_node));
+    if (!n)
+        return NULL;
+    atomic_init(&n->next, NULL);
+    n->value = value;
+    n->retired_next = NULL;
+    return n;
+}
+
+static void copy_value(char *sp, size_t bufsize, const char *value)
+{
+    if (sp && bufsize) {
+        strncpy(sp, value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+}
+
+cqueue_t *cq_new(cq_kind_t kind)
+{
+    cqueue_t *q = malloc(sizeof(cqueue_t));
+    if (!q)
+        return NULL;
+    struct cq_node *dummy = node_new(NULL);
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+    q->kind = kind;
+    q->id = atomic_fetch_add(&cq_next_id, 1);
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    atomic_init(&q->recs, NULL);
+    pthread_mutex_init(&q->head_lock, NULL);
+    pthread_mutex_init(&q->tail_lock, NULL);
+    pthread_mutex_init(&q->recs_lock, NULL);
+    return q;
+}
+
+void cq_free(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    struct cq_node *n = atomic_load(&q->head);
+    while (n) {
+        struct cq_node *next = atomic_load(&n->next);
+        free(n->value);
+        free(n);
+        n = next;
+    }
+
+    struct hp_rec *r = atomic_load(&q->recs);
+    while (r) {
+        struct hp_rec *next = r->next;
+        struct cq_node *d = r->retired;
+        while (d) {
+            struct cq_node *dn = d->retired_next;
+            free(d);
+            d = dn;
+        }
+        free(r);
+        r = next;
+    }
+
+    pthread_mutex_destroy(&q->head_lock);
+    pthread_mutex_destroy(&q->tail_lock);
+    pthread_mutex_destroy(&q->recs_lock);
+    free(q);
+}
+
+/*
+ * Two-lock variant
+ */
+
+static bool twolock_insert(cqueue_t *q, struct cq_node *n)
+{
+    pthread_mutex_lock(&q->tail_lock);
+    struct cq_node *t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    /* May be read concurrently by a consumer holding head_lock */
+    atomic_store_explicit(&t->next, n, memory_order_release);
+    atomic_store_explicit(&q->tail, n, memory_order_relaxed);
+    pthread_mutex_unlock(&q->tail_lock);
+    return true;
+}
+
+static bool twolock_remove(cqueue_t *q, char *sp, size_t bufsize)
+{
+    pthread_mutex_lock(&q->head_lock);
+    struct cq_node *h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct cq_node *next = atomic_load_explicit(&h->next, memory_order_acquire);
+    if (!next) {
+        pthread_mutex_unlock(&q->head_lock);
+        return false;
+    }
+    char *value = next->value;
+    next->value = NULL;
+    atomic_store_explicit(&q->head, next, memory_order_relaxed);
+    pthread_mutex_unlock(&q->head_lock);
+
+    copy_value(sp, bufsize, value);
+    free(value);
+    free(h);
+    return true;
+}
+
+/*
+ * Lock-free variant
+ */
+
+/* Find or create the hazard pointer record of the calling thread */
+static struct hp_rec *hp_get(cqueue_t *q)
+{
+    if (hp_cache.id == q->id)
+        return hp_cache.rec;
+
+    pthread_t self = pthread_self();
+    struct hp_rec *r;
+    for (r = atomic_load(&q->recs); r; r = r->next) {
+        if (pthread_equal(r->owner, self))
+            break;
+    }
+
+    if (!r) {
+        r = malloc(sizeof(struct hp_rec));
+        if (!r)
+            return NULL;
+        for (int i = 0; i < HP_PER_THREAD; i++)
+            atomic_init(&r->hp[i], NULL);
+        r->owner = self;
+        r->retired = NULL;
+        r->nretired = 0;
+        /* Records are only ever prepended, so readers need no lock */
+        pthread_mutex_lock(&q->recs_lock);
+        r->next = atomic_load(&q->recs);
+        atomic_store(&q->recs, r);
+        pthread_mutex_unlock(&q->recs_lock);
+    }
+
+    hp_cache.id = q->id;
+    hp_cache.rec = r;
+    return r;
+}
+
+/* Free the retired nodes of r that no thread has declared hazardous */
+static void hp_scan(cqueue_t *q, struct hp_rec *r)
+{
+    /*
+     * Records added after this snapshot belong to threads that started
+     * after the nodes were unlinked, so they cannot hold any of them.
+     */
+    struct hp_rec *first = atomic_load(&q->recs);
+    size_t cap = 0;
+    for (struct hp_rec *p = first; p; p = p->next)
+        cap += HP_PER_THREAD;
+    struct cq_node **hazards = malloc(cap * sizeof(struct cq_node *));
+    if (!hazards)
+        return;
+
+    size_t nhaz = 0;
+    for (struct hp_rec *p = first; p; p = p->next) {
+        for (int i = 0; i < HP_PER_THREAD; i++) {
+            struct cq_node *h = atomic_load(&p->hp[i]);
+            if (h)
+                hazards[nhaz++] = h;
+        }
+    }
+
+    struct cq_node *keep = NULL, *d = r->retired;
+    size_t nkeep = 0;
+    while (d) {
+        struct cq_node *next = d->retired_next;
+        bool hazardous = false;
+        for (size_t i = 0; i < nhaz && !hazardous; i++)
+            hazardous = hazards[i] == d;
+        if (hazardous) {
+            d->retired_next = keep;
+            keep = d;
+            nkeep++;
+        } else {
+            free(d);
+        }
+        d = next;
+    }
+    r->retired = keep;
+    r->nretired = nkeep;
+    free(hazards);
+}
+
+static void hp_retire(cqueue_t *q, struct hp_rec *r, struct cq_node *n)
+{
+    n->retired_next = r->retired;
+    r->retired = n;
+    if (++r->nretired >= HP_SCAN_THRESHOLD)
+        hp_scan(q, r);
+}
+
+static bool lockfree_insert(cqueue_t *q, struct cq_node *n)
+{
+    struct hp_rec *r = hp_get(q);
+    if (!r)
+        return false;
+
+    for (;;) {
+        struct cq_node *t = atomic_load(&q->tail);
+        atomic_store(&r->hp[0], t);
+        if (t != atomic_load(&q->tail))
+            continue;
+        struct cq_node *next = atomic_load(&t->next);
+        if (t != atomic_load(&q->tail))
+            continue;
+        if (next) {
+            /* Tail is lagging behind; help the other producer */
+            atomic_compare_exchange_weak(&q->tail, &t, next);
+            continue;
+        }
+        struct cq_node *expected = NULL;
+        if (atomic_compare_exchange_weak(&t->next, &expected, n)) {
+            atomic_compare_exchange_strong(&q->tail, &t, n);
+            break;
+        }
+    }
+    atomic_store(&r->hp[0], NULL);
+    return true;
+}
+
+static bool lockfree_remove(cqueue_t *q, char *sp, size_t bufsize)
+{
+    struct hp_rec *r = hp_get(q);
+    if (!r)
+        return false;
+
+    struct cq_node *h, *next;
+    for (;;) {
+        h = atomic_load(&q->head);
+        atomic_store(&r->hp[0], h);
+        if (h != atomic_load(&q->head))
+            continue;
+        struct cq_node *t = atomic_load(&q->tail);
+        next = atomic_load(&h->next);
+        atomic_store(&r->hp[1], next);
+        if (h != atomic_load(&q->head))
+            continue;
+        if (!next) {
+            atomic_store(&r->hp[0], NULL);
+            atomic_store(&r->hp[1], NULL);
+            return false;
+        }
+        if (h == t) {
+            atomic_compare_exchange_weak(&q->tail, &t, next);
+            continue;
+        }
+        if (atomic_compare_exchange_weak(&q->head, &h, next))
+            break;
+    }
+
+    /* Winning the exchange makes this thread the owner of the value */
+    char *value = next->value;
+    next->value = NULL;
+    atomic_store(&r->hp[0], NULL);
+    atomic_store(&r->hp[1], NULL);
+
+    copy_value(sp, bufsize, value);
+    free(value);
+    hp_retire(q, r, h);
+    return true;
+}
+
+bool cq_insert_tail(cqueue_t *q, const char *s)
+{
+    if (!q)
+        return false;
+    char *value = strdup(s);
+    if (!value)
+        return false;
+    struct cq_node *n = node_new(value);
+    if (!n) {
+        free(value);
+        return false;
+    }
+
+    bool ok = q->kind == CQ_LOCK_FREE ? lockfree_insert(q, n)
+                                      : twolock_insert(q, n);
+    if (!ok) {
+        free(value);
+        free(n);
+    }
+    return ok;
+}
+
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize)
+{
+    if (!q)
+        return false;
+    return q->kind == CQ_LOCK_FREE ? lockfree_remove(q, sp, bufsize)
+                                   : twolock_remove(q, sp, bufsize);
+}
@@ -0,0 +1,50 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/*
+ * Concurrent FIFO queue of strings, safe to share between threads.
+ *
+ * Two implementations are provided behind the same interface:
+ *  - CQ_TWO_LOCK: the two-lock queue of Michael and Scott, where producers
+ *    and consumers only contend among themselves.
+ *  - CQ_LOCK_FREE: the non-blocking Michael-Scott queue, with removed nodes
+ *    reclaimed through hazard pointers.
+ *
+ * Unlike queue.c, this code uses the system allocator directly, since the
+ * allocation checks in harness.c are not thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum { CQ_TWO_LOCK, CQ_LOCK_FREE } cq_kind_t;
+
+typedef struct cqueue cqueue_t;
+
+/*
+ * Create empty concurrent queue.
+ * Return NULL if could not allocate space.
+ */
+cqueue_t *cq_new(cq_kind_t kind);
+
+/*
+ * Free ALL storage used by queue.
+ * Must not race with any other operation on q.  No effect if q is NULL.
+ */
+void cq_free(cqueue_t *q);
+
+/*
+ * Attempt to insert a copy of s at tail of queue.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool cq_insert_tail(cqueue_t *q, const char *s);
+
+/*
+ * Attempt to remove element from head of queue.
+ * If sp is non-NULL, copy the removed string to *sp (up to a maximum of
+ * bufsize-1 characters, plus a null terminator.)
+ * Return false if q is NULL or empty.
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize);
+
+#endif /* LAB0_CQUEUE_H */
@@ -15,8 +15,8 @@
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 
-/* Number of measurements per test */
-const size_t n_measure = N_MEASURE;
+/* Number of measurements per test, changed with option dudect_measure */
+size_t n_measure = N_MEASURE;
 
 const int drop_size = 20;
 
@@ -25,14 +25,30 @@ const int drop_size = 20;
  */
 static struct list_head *l = NULL;
 
-static char random_string[N_MEASURE][8];
-static int random_string_iter = 0;
+static char (*random_string)[8] = NULL;
+static size_t random_string_cnt = 0;
+static size_t random_string_iter = 0;
+
+/* Elements per call in the bulk modes, at most DUT_MAX_BULK */
+int bulk_size = 16;
+
+static char *bulk_strings[DUT_MAX_BULK];
+
+/* Elements held by the queue under test and the ballast of new_padded() */
+#define PADDED_SIZE (10000 + DUT_MAX_BULK + 1)
+static struct list_head *ballast = NULL;
 
 enum {
     test_insert_head,
     test_insert_tail,
     test_remove_head,
     test_remove_tail,
+    test_size,
+    test_delete_mid,
+    test_insert_head_bulk,
+    test_insert_tail_bulk,
+    test_remove_head_bulk,
+    test_remove_tail_bulk,
 };
 
 /* Implement the necessary queue interface to simulation */
@@ -43,22 +59,80 @@ void init_dut(void)
 
 char *get_random_string(void)
 {
-    random_string_iter = (random_string_iter + 1) % N_MEASURE;
+    random_string_iter = (random_string_iter + 1) % n_measure;
     return random_string[random_string_iter];
 }
 
+/* Fill bulk_strings with the next bulk_size random strings */
+static char **get_random_strings(void)
+{
+    for (int i = 0; i < bulk_size; i++)
+        bulk_strings[i] = get_random_string();
+    return bulk_strings;
+}
+
+/* Length of the queue for measurement i, zero for class 0 */
+static int queue_length(uint8_t *input_data, size_t i)
+{
+    return *(uint16_t *) (input_data + i * chunk_size) % 10000;
+}
+
+/*
+ * Create the queue under test with n elements, then a second queue topping
+ * the element count up to the same total for both classes.  Otherwise the
+ * allocator and the caches are far busier for class 1, and operations that
+ * allocate or free in the measured region look slower there even when they
+ * are O(1).
+ */
+static void new_padded(int n)
+{
+    dut_new();
+    dut_insert_head(get_random_string(), n);
+    struct list_head *queue = l;
+    dut_new();
+    dut_insert_head(get_random_string(), PADDED_SIZE - n);
+    ballast = l;
+    l = queue;
+}
+
+static void free_padded(void)
+{
+    dut_free();
+    l = ballast;
+    dut_free();
+}
+
+/* Release the elements taken by a bulk removal */
+static void release_all(struct list_head *out)
+{
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, out, list)
+        q_release_element(e);
+    INIT_LIST_HEAD(out);
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
-    randombytes(input_data, n_measure * chunk_size);
+    prng_fill(input_data, n_measure * chunk_size);
+    prng_fill(classes, n_measure);
     for (size_t i = 0; i < n_measure; i++) {
-        classes[i] = randombit();
+        classes[i] &= 1;
         if (classes[i] == 0)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
     }
 
-    for (size_t i = 0; i < N_MEASURE; ++i) {
+    if (random_string_cnt != n_measure) {
+        free(random_string);
+        random_string = malloc(n_measure * sizeof(*random_string));
+        if (!random_string)
+            exit(111);
+        random_string_cnt = n_measure;
+        random_string_iter = 0;
+    }
+
+    for (size_t i = 0; i < n_measure; ++i) {
         /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
+        prng_fill((uint8_t *) random_string[i], 7);
         random_string[i][7] = 0;
     }
 }
@@ -68,8 +142,9 @@ void measure(int64_t *before_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == test_insert_head || mode == test_insert_tail ||
-           mode == test_remove_head || mode == test_remove_tail);
+    assert(mode >= test_insert_head && mode <= test_remove_tail_bulk);
+    assert(bulk_size > 0 && bulk_size <= DUT_MAX_BULK);
+    LIST_HEAD(out);
 
     switch (mode) {
     case test_insert_head:
@@ -126,16 +201,65 @@ void measure(int64_t *before_ticks,
             dut_free();
         }
         break;
-    default:
+    case test_size:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
+            new_padded(queue_length(input_data, i));
             before_ticks[i] = cpucycles();
             dut_size(1);
             after_ticks[i] = cpucycles();
-            dut_free();
+            free_padded();
         }
+        break;
+    case test_delete_mid:
+        /* Both classes have a middle node to delete */
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            new_padded(1 + queue_length(input_data, i));
+            before_ticks[i] = cpucycles();
+            dut_delete_mid();
+            after_ticks[i] = cpucycles();
+            free_padded();
+        }
+        break;
+    case test_insert_head_bulk:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            char **sv = get_random_strings();
+            new_padded(queue_length(input_data, i));
+            before_ticks[i] = cpucycles();
+            dut_insert_head_bulk(sv, bulk_size);
+            after_ticks[i] = cpucycles();
+            free_padded();
+        }
+        break;
+    case test_insert_tail_bulk:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            char **sv = get_random_strings();
+            new_padded(queue_length(input_data, i));
+            before_ticks[i] = cpucycles();
+            dut_insert_tail_bulk(sv, bulk_size);
+            after_ticks[i] = cpucycles();
+            free_padded();
+        }
+        break;
+    case test_remove_head_bulk:
+        /* Both classes keep some elements, so take the same path */
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            new_padded(bulk_size + 1 + queue_length(input_data, i));
+            before_ticks[i] = cpucycles();
+            dut_remove_head_bulk(&out, bulk_size);
+            after_ticks[i] = cpucycles();
+            release_all(&out);
+            free_padded();
+        }
+        break;
+    case test_remove_tail_bulk:
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+            new_padded(bulk_size + 1 + queue_length(input_data, i));
+            before_ticks[i] = cpucycles();
+            dut_remove_tail_bulk(&out, bulk_size);
+            after_ticks[i] = cpucycles();
+            release_all(&out);
+            free_padded();
+        }
+        break;
     }
 }
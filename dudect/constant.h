@@ -24,8 +24,18 @@
             q_insert_tail(l, s); \
     } while (0)
 
+#define dut_delete_mid() ((void) (q_delete_mid(l)))
+
+#define dut_insert_head_bulk(sv, n) ((void) (q_insert_head_bulk(l, sv, n)))
+#define dut_insert_tail_bulk(sv, n) ((void) (q_insert_tail_bulk(l, sv, n)))
+#define dut_remove_head_bulk(out, n) ((void) (q_remove_head_bulk(l, out, n)))
+#define dut_remove_tail_bulk(out, n) ((void) (q_remove_tail_bulk(l, out, n)))
+
 #define dut_free() ((void) (q_free(l)))
 
+/* Upper bound on the elements moved by one call in the bulk modes */
+#define DUT_MAX_BULK 64
+
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 void measure(int64_t *before_ticks,
@@ -23,33 +23,75 @@
  *    measurements (non-linear transform)
  *
  *  - as long as any of the different test fails, the code will be deemed
- *    variable time.
+ *    variable time.  This only holds with option dudect_full: by default the
+ *    verdict comes from the uncropped test alone, and the others are only
+ *    reported.  The queue built for class 1 leaves the caches colder than
+ *    the empty queue of class 0, and the cropped tests are sharp enough to
+ *    see that difference in O(1) code.  A test only takes part once it holds
+ *    as many measurements as the uncropped one needs for a verdict.
  */
 
+/* For sched_setaffinity() */
+#define _GNU_SOURCE
+
 #include "fixture.h"
 #include <assert.h>
 #include <math.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "../console.h"
 #include "../random.h"
 #include "constant.h"
 #include "ttest.h"
 
-#define enough_measure 10000
 #define test_tries 10
 
+/* Upper bound on dudect_workers */
+#define MAX_WORKERS 256
+
+/* Workers used by default, one per CPU the process may run on up to this */
+#define DEFAULT_WORKERS 8
+
 extern const int drop_size;
 extern const size_t chunk_size;
-extern const size_t n_measure;
+extern size_t n_measure;
+extern int bulk_size;
+
+/*
+ * t[0] holds the uncropped measurements, t[1 + i] those below percentiles[i],
+ * and the last context the second order test on squared deviations.
+ */
+#define N_PERCENTILES 100
+#define N_TESTS (1 + N_PERCENTILES + 1)
 static t_ctx *t;
+static int64_t percentiles[N_PERCENTILES];
+static bool have_percentiles;
+
+/*
+ * The second order test is centered on the class means, so it starts once
+ * the measurements of the whole run reach a tenth of dudect_enough and the
+ * means have settled.  With dudect_full the run is that much longer, which
+ * leaves the second order test with dudect_enough measurements of its own.
+ */
+#define SETTLE_DIV 10
+
+/* Measurements of the context being filled after which the means settle */
+static double settle_at;
+
+int dudect_measure = 150;
+int dudect_enough = 10000;
+int dudect_threshold = 10;
+int dudect_workers = 0;
+int dudect_full = 0;
 
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
-    t_threshold_moderate = 10, /* Test failed */
 };
 
 static void __attribute__((noreturn)) die(void)
@@ -65,7 +107,43 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Set the cropping thresholds from the timings of one batch.  Threshold i
+ * keeps the fastest 1 - 0.5^(10 (i + 1) / N_PERCENTILES) of the timings, so
+ * the crops get denser towards the tail, where the outliers live.
+ */
+static void prepare_percentiles(const int64_t *exec_times)
+{
+    int64_t *sorted = calloc(n_measure, sizeof(int64_t));
+    if (!sorted)
+        die();
+    size_t n = 0;
+    for (size_t i = 0; i < n_measure; i++) {
+        if (exec_times[i] > 0)
+            sorted[n++] = exec_times[i];
+    }
+    if (n == 0) {
+        free(sorted);
+        return;
+    }
+    qsort(sorted, n, sizeof(int64_t), cmp_int64);
+    for (size_t i = 0; i < N_PERCENTILES; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES);
+        percentiles[i] = sorted[(size_t) (which * n)];
+    }
+    free(sorted);
+    have_percentiles = true;
+}
+
+static void update_statistics(t_ctx *ctx,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
     for (size_t i = 0; i < n_measure; i++) {
         int64_t difference = exec_times[i];
@@ -74,24 +152,61 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&ctx[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several cropping
+         * thresholds
+         */
+        for (size_t crop = 0; crop < N_PERCENTILES; crop++) {
+            if (difference < percentiles[crop])
+                t_push(&ctx[1 + crop], difference, classes[i]);
+        }
+
+        /* do a second-order test once the means have settled */
+        if (ctx[0].n[0] + ctx[0].n[1] >= settle_at) {
+            double centered = difference - ctx[0].mean[classes[i]];
+            t_push(&ctx[N_TESTS - 1], centered * centered, classes[i]);
+        }
     }
 }
 
+/*
+ * The test with the largest |t|.  Cropped and second order tests only take
+ * part once they hold dudect_enough measurements, like the uncropped one.
+ */
+static t_ctx *max_test(void)
+{
+    t_ctx *ret = &t[0];
+    double max = fabs(t_compute(&t[0]));
+    for (int i = 1; i < N_TESTS; i++) {
+        if (t[i].n[0] + t[i].n[1] < dudect_enough)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > max) {
+            max = x;
+            ret = &t[i];
+        }
+    }
+    return ret;
+}
+
 static bool report(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
-    double max_tau = max_t / sqrt(number_traces_max_t);
+    double number_traces = t[0].n[0] + t[0].n[1];
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    if (number_traces < dudect_enough) {
         printf("not enough measurements (%.0f still to go).\n",
-               enough_measure - number_traces_max_t);
+               dudect_enough - number_traces);
         return false;
     }
 
+    t_ctx *ctx = dudect_full ? max_test() : &t[0];
+    double max_t = fabs(t_compute(ctx));
+    double number_traces_max_t = ctx->n[0] + ctx->n[1];
+    double max_tau = max_t / sqrt(number_traces_max_t);
+
     /* max_t: the t statistic value
      * max_tau: a t value normalized by sqrt(number of measurements).
      *          this way we can compare max_tau taken with different
@@ -102,22 +217,30 @@ static bool report(void)
      *            detect the leak, if present. "barely detect the
      *            leak" = have a t value greater than 5.
      */
-    printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e.\n", max_t, max_tau,
+    printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e", max_t, max_tau,
            (double) (5 * 5) / (double) (max_tau * max_tau));
+    if (!dudect_full)
+        printf(", all tests max t: %+7.2f", fabs(t_compute(max_test())));
+    printf(".\n");
 
     /* Definitely not constant time */
     if (max_t > t_threshold_bananas)
         return false;
 
     /* Probably not constant time. */
-    if (max_t > t_threshold_moderate)
+    if (max_t > dudect_threshold)
         return false;
 
     /* For the moment, maybe constant time. */
     return true;
 }
 
-static bool doit(int mode)
+/*
+ * Measure one batch of n_measure executions and add it to the N_TESTS
+ * contexts at ctx.  The first batch after init_once() only sets the
+ * cropping thresholds.
+ */
+static void run_batch(int mode, t_ctx *ctx)
 {
     int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
@@ -134,35 +257,183 @@ static bool doit(int mode)
 
     measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+    if (have_percentiles)
+        update_statistics(ctx, exec_times, classes);
+    else
+        prepare_percentiles(exec_times);
 
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
     free(classes);
     free(input_data);
+}
 
-    return ret;
+static bool doit(int mode)
+{
+    run_batch(mode, t);
+    return report();
+}
+
+/* Pin the calling process to the w-th CPU it is allowed to run on */
+static void pin_cpu(const cpu_set_t *avail, int w)
+{
+    int ncpu = CPU_COUNT(avail);
+    if (ncpu <= 0)
+        return;
+    for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, avail) || seen++ != w % ncpu)
+            continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        sched_setaffinity(0, sizeof(one), &one);
+        return;
+    }
+}
+
+/* Read exactly len bytes unless the writer goes away first */
+static bool read_full(int fd, void *buf, size_t len)
+{
+    for (size_t got = 0; got < len;) {
+        ssize_t n = read(fd, (char *) buf + got, len - got);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+/*
+ * Measure share of the batches into fresh contexts at local.  The cropping
+ * thresholds are taken first from a batch of its own, so that they match
+ * the conditions, such as the CPU and its load, the share runs under.
+ * Workers measure at the same pace, so the merged measurements reach the
+ * point where the means settle when each worker reaches its part of it.
+ */
+static void run_share(int mode, int share, int batches, t_ctx *local)
+{
+    for (int i = 0; i < N_TESTS; i++)
+        t_init(&local[i]);
+    have_percentiles = false;
+    settle_at = (double) dudect_enough / SETTLE_DIV * share / batches;
+    for (int i = 0; i <= share; i++)
+        run_batch(mode, local);
+}
+
+static void merge_share(const t_ctx *local)
+{
+    for (int i = 0; i < N_TESTS; i++)
+        t_merge(&t[i], &local[i]);
+}
+
+/* Processes to measure with: dudect_workers, or by default one per CPU */
+static int worker_count(const cpu_set_t *avail)
+{
+    if (dudect_workers > 0)
+        return dudect_workers < MAX_WORKERS ? dudect_workers : MAX_WORKERS;
+    int ncpu = CPU_COUNT(avail);
+    if (ncpu < 1)
+        return 1;
+    return ncpu < DEFAULT_WORKERS ? ncpu : DEFAULT_WORKERS;
+}
+
+/*
+ * Share the batches among nw child processes.  Each worker is pinned to its
+ * own CPU where possible, keeps its own statistics and sends them back
+ * through a pipe once done; the parent merges them into t.  A share whose
+ * process cannot be started is measured by the parent.
+ */
+static bool run_workers(int mode, int batches, int nw, const cpu_set_t *avail)
+{
+    pid_t pids[MAX_WORKERS];
+    int fds[MAX_WORKERS];
+
+    /* Children must not flush output buffered by the parent */
+    fflush(stdout);
+    for (int w = 0; w < nw; w++) {
+        int share = batches / nw + (w < batches % nw);
+        int pfd[2];
+        pids[w] = -1;
+        t_ctx local[N_TESTS];
+        /* Otherwise every worker would measure the same inputs */
+        uint64_t seed = prng_next();
+        if (pipe(pfd) != 0) {
+            run_share(mode, share, batches, local);
+            merge_share(local);
+            continue;
+        }
+        pids[w] = fork();
+        if (pids[w] == 0) {
+            close(pfd[0]);
+            prng_seed(seed);
+            pin_cpu(avail, w);
+            run_share(mode, share, batches, local);
+            bool ok = write(pfd[1], local, sizeof(local)) == sizeof(local);
+            _exit(ok ? 0 : 1);
+        }
+        close(pfd[1]);
+        if (pids[w] < 0) {
+            close(pfd[0]);
+            run_share(mode, share, batches, local);
+            merge_share(local);
+            continue;
+        }
+        fds[w] = pfd[0];
+    }
+
+    for (int w = 0; w < nw; w++) {
+        if (pids[w] < 0)
+            continue;
+        t_ctx part[N_TESTS];
+        bool ok = read_full(fds[w], part, sizeof(part));
+        close(fds[w]);
+        waitpid(pids[w], NULL, 0);
+        if (ok)
+            merge_share(part);
+    }
+    return report();
 }
 
 static void init_once(void)
 {
     init_dut();
-    t_init(t);
+    for (int i = 0; i < N_TESTS; i++)
+        t_init(&t[i]);
+    have_percentiles = false;
 }
 
 static bool TEST_CONST(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    t = malloc(N_TESTS * sizeof(t_ctx));
+    if (!t)
+        die();
+
+    /* Every batch needs at least one measurement left after dropping */
+    n_measure = dudect_measure > drop_size * 2 ? dudect_measure
+                                               : drop_size * 2 + 1;
+    int enough = dudect_enough;
+    /* A tenth more when the second order test is judged, see SETTLE_DIV */
+    if (dudect_full)
+        enough += dudect_enough / SETTLE_DIV;
+    int batches = enough / (n_measure - drop_size * 2) + 1;
+    settle_at = (double) dudect_enough / SETTLE_DIV;
+    cpu_set_t avail;
+    if (sched_getaffinity(0, sizeof(avail), &avail) != 0)
+        CPU_ZERO(&avail);
+    int nw = worker_count(&avail);
 
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
         init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        if (nw > 1) {
+            result = run_workers(mode, batches, nw, &avail);
+        } else {
+            /* One more batch, as the first one sets the percentiles */
+            for (int i = 0; i <= batches; ++i)
+                result = doit(mode);
+        }
         printf("\033[A\033[2K\033[A\033[2K");
         if (result == true)
             break;
@@ -190,3 +461,37 @@ bool is_remove_tail_const(void)
 {
     return TEST_CONST("remove_tail", 3);
 }
+
+bool is_size_const(void)
+{
+    return TEST_CONST("size", 4);
+}
+
+bool is_delete_mid_const(void)
+{
+    return TEST_CONST("delete_mid", 5);
+}
+
+bool is_insert_head_bulk_const(int n)
+{
+    bulk_size = n;
+    return TEST_CONST("insert_head_bulk", 6);
+}
+
+bool is_insert_tail_bulk_const(int n)
+{
+    bulk_size = n;
+    return TEST_CONST("insert_tail_bulk", 7);
+}
+
+bool is_remove_head_bulk_const(int n)
+{
+    bulk_size = n;
+    return TEST_CONST("remove_head_bulk", 8);
+}
+
+bool is_remove_tail_bulk_const(int n)
+{
+    bulk_size = n;
+    return TEST_CONST("remove_tail_bulk", 9);
+}
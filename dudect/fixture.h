@@ -4,10 +4,25 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Parameters of the tests, exposed as options by qtest */
+extern int dudect_measure;   /* Executions measured per batch */
+extern int dudect_enough;    /* Measurements needed before a verdict */
+extern int dudect_threshold; /* Largest |t| still deemed constant time */
+extern int dudect_workers;   /* Processes sharing the batches, 0: per CPU */
+extern int dudect_full;      /* Judge on all tests, not just the uncropped */
+
 /* Interface to test if function is constant */
 bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
 bool is_remove_head_const(void);
 bool is_remove_tail_const(void);
+bool is_size_const(void);
+bool is_delete_mid_const(void);
+
+/* Variants moving n elements per call, 1 <= n <= DUT_MAX_BULK */
+bool is_insert_head_bulk_const(int n);
+bool is_insert_tail_bulk_const(int n);
+bool is_remove_head_bulk_const(int n);
+bool is_remove_tail_bulk_const(int n);
 
 #endif
@@ -11,5 +11,6 @@ typedef struct {
 void t_push(t_ctx *ctx, double x, uint8_t class);
 double t_compute(t_ctx *ctx);
 void t_init(t_ctx *ctx);
+void t_merge(t_ctx *dst, const t_ctx *src);
 
 #endif
@@ -2,6 +2,7 @@
 
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,12 +22,18 @@
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
+/* Value at start of blocks allocated in fast mode without tracking */
+#define MAGICFAST 0xfa57b10c
+
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* In fast mode, one block out of this many is still fully tracked */
+#define FAST_SAMPLE 64
+
 /* Data structures used by our code */
 
 /*
@@ -43,16 +50,33 @@ typedef struct BELE {
 
 static block_ele_t *allocated = NULL;
 static size_t allocated_count = 0;
+static alloc_stats_t stats;
+
+/*
+ * Set of the allocated blocks, keyed on their address, so that cautious mode
+ * can validate a block in constant time instead of walking the list above.
+ * Open addressing with linear probing; removal shifts later entries of the
+ * cluster back, so no tombstones are needed.  The table is kept at most
+ * half full.
+ */
+#define BLOCK_SET_MIN 1024
+static block_ele_t **block_set = NULL;
+static size_t block_set_cap = 0;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* How thoroughly blocks are checked, HARNESS_FULL or HARNESS_FAST */
+int harness_mode = HARNESS_FULL;
+static size_t fast_count = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Seconds a risky operation may take, 0 for no limit */
+int time_limit = 1;
 
 /*
  * Data for managing exceptions
@@ -68,10 +92,84 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
+    if (fail_probability <= 0)
+        return false;
     double weight = (double) random() / RAND_MAX;
     return (weight < 0.01 * fail_probability);
 }
 
+static inline size_t block_slot(const block_ele_t *b)
+{
+    /* Fibonacci hashing; the low bits of a heap address are mostly zero */
+    return (size_t) (((uintptr_t) b * 0x9e3779b97f4a7c15ull) >> 17) &
+           (block_set_cap - 1);
+}
+
+static bool block_set_grow()
+{
+    size_t cap = block_set_cap ? 2 * block_set_cap : BLOCK_SET_MIN;
+    block_ele_t **table = calloc(cap, sizeof(block_ele_t *));
+    if (!table)
+        return false;
+
+    block_ele_t **old = block_set;
+    size_t old_cap = block_set_cap;
+    block_set = table;
+    block_set_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i])
+            continue;
+        size_t j = block_slot(old[i]);
+        while (block_set[j])
+            j = (j + 1) & (cap - 1);
+        block_set[j] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static bool block_set_insert(block_ele_t *b)
+{
+    if (2 * (allocated_count + 1) > block_set_cap && !block_set_grow())
+        return false;
+    size_t i = block_slot(b);
+    while (block_set[i])
+        i = (i + 1) & (block_set_cap - 1);
+    block_set[i] = b;
+    return true;
+}
+
+/* Return the slot holding b, or block_set_cap if b is not in the set */
+static size_t block_set_find(const block_ele_t *b)
+{
+    if (!block_set_cap)
+        return 0;
+    for (size_t i = block_slot(b); block_set[i];
+         i = (i + 1) & (block_set_cap - 1)) {
+        if (block_set[i] == b)
+            return i;
+    }
+    return block_set_cap;
+}
+
+static void block_set_remove(const block_ele_t *b)
+{
+    size_t i = block_set_find(b);
+    if (i == block_set_cap)
+        return;
+
+    /* Move back entries whose home slot lies at or before the hole */
+    size_t mask = block_set_cap - 1;
+    for (size_t j = (i + 1) & mask; block_set[j]; j = (j + 1) & mask) {
+        size_t home = block_slot(block_set[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            block_set[i] = block_set[j];
+            i = j;
+        }
+    }
+    block_set[i] = NULL;
+}
+
 /*
  * Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
@@ -84,15 +182,11 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    if (b->magic_header == MAGICFAST)
+        return b;
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (block_set_find(b) == block_set_cap) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -134,29 +228,35 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
+    /* Fast mode only keeps the canaries, except on a sample of the blocks */
+    bool tracked =
+        harness_mode != HARNESS_FAST || ++fast_count % FAST_SAMPLE == 0;
     block_ele_t *new_block =
         malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
+    if (!new_block || (tracked && !block_set_insert(new_block))) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
+    new_block->magic_header = tracked ? MAGICHEADER : MAGICFAST;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
+    if (tracked) {
+        memset(p, FILLCHAR, size);
+        new_block->next = allocated;
+        new_block->prev = NULL;
+        if (allocated)
+            allocated->prev = new_block;
+        allocated = new_block;
+    }
     allocated_count++;
+    stats.malloc_cnt++;
+    stats.malloc_bytes += size;
+    if (allocated_count > stats.peak_blocks)
+        stats.peak_blocks = allocated_count;
 
     return p;
 }
@@ -167,12 +267,44 @@ void *test_calloc(size_t nelem, size_t elsize)
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
-    size_t size = nelem * elsize;  // TODO: check for overflow
+    if (elsize && nelem > SIZE_MAX / elsize) {
+        report_event(MSG_WARN, "Calloc size overflow, returning NULL");
+        return NULL;
+    }
+    size_t size = nelem * elsize;
     void *ptr = test_malloc(size);
-    memset(ptr, 0, size);
+    if (ptr)
+        memset(ptr, 0, size);
     return ptr;
 }
 
+/*
+ * Always move the block, so that callers holding on to the old address are
+ * caught by the checks on freed blocks.  On failure the block is left as is.
+ */
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    if (!p)
+        return test_malloc(size);
+    if (size == 0) {
+        test_free(p);
+        return NULL;
+    }
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    }
+
+    block_ele_t *b = find_header(p);
+    void *new = test_malloc(size);
+    if (!new)
+        return NULL;
+    memcpy(new, p, b->payload_size < size ? b->payload_size : size);
+    test_free(p);
+    return new;
+}
+
 void test_free(void *p)
 {
     if (noallocate_mode) {
@@ -192,19 +324,25 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
+    bool tracked = b->magic_header != MAGICFAST;
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    stats.free_cnt++;
+    stats.free_bytes += b->payload_size;
+
+    if (tracked) {
+        memset(p, FILLCHAR, b->payload_size);
+        /* Unlink from list */
+        block_ele_t *bn = b->next;
+        block_ele_t *bp = b->prev;
+        if (bp)
+            bp->next = bn;
+        else
+            allocated = bn;
+        if (bn)
+            bn->prev = bp;
+        block_set_remove(b);
+    }
 
     free(b);
     allocated_count--;
@@ -226,6 +364,16 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void allocation_stats(alloc_stats_t *st)
+{
+    *st = stats;
+}
+
+void allocation_reset_peak()
+{
+    stats.peak_blocks = allocated_count;
+}
+
 /*
  * Implementation of functions for testing
  */
@@ -280,7 +428,7 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
+    if (limit_time && time_limit > 0) {
         alarm(time_limit);
         time_limited = true;
     }
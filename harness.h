@@ -15,16 +15,46 @@ void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
 
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Counters of the test_malloc family since program start */
+typedef struct {
+    size_t malloc_cnt;   /* Successful allocations */
+    size_t free_cnt;     /* Blocks freed */
+    size_t malloc_bytes; /* Payload bytes allocated */
+    size_t free_bytes;   /* Payload bytes freed */
+    size_t peak_blocks;  /* Most blocks allocated at once since last reset */
+} alloc_stats_t;
+
+/* Copy the allocation counters to *stats */
+void allocation_stats(alloc_stats_t *stats);
+
+/* Restart tracking of peak_blocks from the current number of blocks */
+void allocation_reset_peak();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seconds allowed for each operation guarded by exception_setup, 0 for none */
+extern int time_limit;
+
+/*
+ * How thoroughly allocations are checked.
+ * Full mode fills every block when it is allocated and freed, and keeps
+ * track of it so that cautious mode can validate frees.  Fast mode only
+ * writes the canaries at both ends of a block and checks them on free,
+ * except for one sampled block in every 64, which gets the full checks.
+ * Counters are kept in both modes, and the mode may change at any time.
+ */
+#define HARNESS_FULL 0
+#define HARNESS_FAST 1
+extern int harness_mode;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -62,6 +92,8 @@ void trigger_exception(char *msg);
 
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
+#define calloc test_calloc
+#define realloc test_realloc
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
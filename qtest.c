@@ -1,13 +1,16 @@
 /* Implementation of testing code for queue code */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h> /* strcasecmp */
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -33,8 +36,12 @@
  */
 #include "queue.h"
 
+#include "bqueue.h"
 #include "console.h"
+#include "cqueue.h"
+#include "random.h"
 #include "report.h"
+#include "server.h"
 
 /* Settable parameters */
 
@@ -43,7 +50,6 @@
 /*
  * How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
@@ -63,19 +69,127 @@ static list_head_meta_t l_meta;
 /* Number of elements in queue */
 static size_t lcnt = 0;
 
+/*
+ * Queues created with new, oldest first.  l_meta and lcnt hold the state of
+ * the current one, which is written back to its context whenever another
+ * queue becomes current.
+ */
+static LIST_HEAD(queue_chain);
+static queue_context_t *current = NULL;
+static int queue_count = 0;
+static int next_queue_id = 0;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST;
 static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Whether new queues carve their elements from a pool */
+static int use_pool = 0;
+
+/* Sorting algorithm used by the sort command */
+#define SORT_MERGE 0
+#define SORT_RADIX 1
+static int sort_algo = SORT_MERGE;
+
+/* Number of threads the merge sort may use */
+static int sort_threads = 1;
+
+/* KiB of elements the sort command keeps in memory before spilling runs */
+static int spill_kb = 0;
+
+/* Whether dedup uses the hash-based variant that accepts unsorted input */
+static int dedup_unsorted = 0;
+
+/* Seed of the generator behind RAND, shuffle and dudect, applied when set */
+static int seed = 0;
+
+static void seed_changed(int oldval)
+{
+    prng_seed(seed);
+}
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+/* Room for the longest string option rand_max may ask for */
+#define RANDSTR_BUFSIZE 256
+
+/* Length range of RAND strings, changed with options rand_min and rand_max */
+static int rand_min = MIN_RANDSTR_LEN;
+static int rand_max = MAX_RANDSTR_LEN - 1;
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
+/* Block deque driven by the bq command */
+static bqueue_t *bq = NULL;
+
+/*
+ * State of a server session: its queues and block deque, put aside while
+ * other sessions run.  Sessions holding any of them meanwhile are counted
+ * in parked_sessions, so that leak checks do not take those for leaks.
+ */
+typedef struct {
+    struct list_head chain;
+    queue_context_t *current;
+    int queue_count;
+    int next_queue_id;
+    bqueue_t *bq;
+    bool parked;
+} session_state_t;
+
+static int parked_sessions = 0;
+
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
+/* Whether no list queue is left, in any session */
+static bool queues_gone(void)
+{
+    return list_empty(&queue_chain) && parked_sessions == 0;
+}
+
+/* Blocks still allocated once no list queue is left, besides the deque */
+static size_t leaked_blocks(void)
+{
+    size_t bcnt = allocation_check();
+    size_t held = bq_blocks(bq);
+    return queues_gone() && bcnt > held ? bcnt - held : 0;
+}
+
+/* Write the state of the current queue back to its context */
+static void save_current(void)
+{
+    if (current) {
+        current->q = l_meta.l;
+        current->size = lcnt;
+    }
+}
+
+/* Make ctx the current queue; NULL leaves no queue current */
+static void set_current(queue_context_t *ctx)
+{
+    save_current();
+    current = ctx;
+    l_meta.l = ctx ? ctx->q : NULL;
+    l_meta.size = ctx ? ctx->size : 0;
+    lcnt = l_meta.size;
+}
+
+/*
+ * Whether the queue is read from l_meta.l->next on.  After q_reverse() it is
+ * read the other way until the links are put back in order.
+ */
+static inline bool queue_forward(void)
+{
+    return !q_desc(l_meta.l)->reversed;
+}
+
+/* First or last node of the non-empty queue, in queue order */
+static inline struct list_head *queue_end(bool first)
+{
+    return first == queue_forward() ? l_meta.l->next : l_meta.l->prev;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -88,19 +202,31 @@ static bool do_free(int argc, char *argv[])
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
     lcnt = 0;
+    if (current) {
+        /* The previous queue becomes current, or the next for the oldest */
+        queue_context_t *ctx = current;
+        struct list_head *other = ctx->chain.prev != &queue_chain
+                                      ? ctx->chain.prev
+                                      : ctx->chain.next;
+        list_del(&ctx->chain);
+        free(ctx);
+        queue_count--;
+        current = NULL;
+        set_current(other != &queue_chain
+                        ? list_entry(other, queue_context_t, chain)
+                        : NULL);
+    }
     show_queue(3);
 
-    size_t bcnt = allocation_check();
+    /* Blocks of other queues and the block deque are still accounted for */
+    size_t bcnt = leaked_blocks();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
@@ -117,59 +243,208 @@ static bool do_new(int argc, char *argv[])
         return false;
     }
 
-    bool ok = true;
-    if (l_meta.l) {
-        report(3, "Freeing old queue");
-        ok = do_free(argc, argv);
+    queue_context_t *ctx = malloc(sizeof(queue_context_t));
+    if (!ctx) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for new queue");
+        return false;
     }
-    error_check();
+    ctx->q = NULL;
+    ctx->size = 0;
+    ctx->id = next_queue_id++;
 
-    if (exception_setup(true)) {
-        l_meta.l = q_new();
-        l_meta.size = 0;
-    }
+    if (exception_setup(true))
+        ctx->q = use_pool ? q_new_pool() : q_new();
     exception_cancel();
-    lcnt = 0;
+
+    list_add_tail(&ctx->chain, &queue_chain);
+    queue_count++;
+    set_current(ctx);
     show_queue(3);
 
-    return ok && !error_check();
+    return !error_check();
+}
+
+/* Make the queue before or after the current one current, wrapping around */
+static bool switch_queue(bool forward, int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current) {
+        report(1, "ERROR: No queue to switch to");
+        return false;
+    }
+
+    struct list_head *node =
+        forward ? current->chain.next : current->chain.prev;
+    if (node == &queue_chain)
+        node = forward ? node->next : node->prev;
+    set_current(list_entry(node, queue_context_t, chain));
+    show_queue(3);
+    return true;
+}
+
+static bool do_prev(int argc, char *argv[])
+{
+    return switch_queue(false, argc, argv);
+}
+
+static bool do_next(int argc, char *argv[])
+{
+    return switch_queue(true, argc, argv);
 }
 
 /*
- * TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+ * Fill buf with rand_min to rand_max random letters, as many as buf_size
+ * leaves room for.
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    size_t lo = rand_min > 0 ? rand_min : 1;
+    size_t hi = rand_max > 0 ? rand_max : 1;
+    if (hi >= buf_size)
+        hi = buf_size - 1;
+    if (lo > hi)
+        lo = hi;
+    size_t len = lo + prng_below(hi - lo + 1);
 
     for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+        buf[n] = charset[prng_below(sizeof charset - 1)];
     }
     buf[len] = '\0';
 }
 
-/* insert head */
-static bool do_ih(int argc, char *argv[])
+/* Argument of gen_insert() */
+typedef struct {
+    char *inserts;
+    bool need_rand;
+} gen_arg_t;
+
+/* Produce the strings for bulk insertion */
+static char *gen_insert(void *arg, int i)
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
+    gen_arg_t *g = arg;
+    if (g->need_rand)
+        fill_rand_string(g->inserts, RANDSTR_BUFSIZE);
+    return g->inserts;
+}
+
+/*
+ * Insert reps elements with a single call to the bulk interface.  Whenever
+ * an allocation fails, it is accounted for like in the one-by-one loop and
+ * insertion resumes with the next element.
+ */
+static bool insert_bulk(bool at_head, char *inserts, bool need_rand, int reps)
+{
+    gen_arg_t g = {inserts, need_rand};
+    bool ok = true, checked = false;
+
+    if (exception_setup(true)) {
+        int r = 0;
+        while (ok && r < reps) {
+            int cnt = at_head ? q_insert_head_gen(l_meta.l, gen_insert, &g,
+                                                  reps - r)
+                              : q_insert_tail_gen(l_meta.l, gen_insert, &g,
+                                                  reps - r);
+            r += cnt;
+            lcnt += cnt;
+            l_meta.size += cnt;
+            if (cnt > 0 && !checked) {
+                /* Check the newest element and its predecessor */
+                bool at_next = at_head == queue_forward();
+                struct list_head *cur = at_next ? l_meta.l->next
+                                                : l_meta.l->prev;
+                struct list_head *prev = at_next ? cur->next : cur->prev;
+                char *cur_inserts = list_entry(cur, element_t, list)->value;
+                checked = true;
+                if (!cur_inserts) {
+                    report(1, "ERROR: Failed to save copy of string in queue");
+                    ok = false;
+                } else if (cur_inserts == inserts) {
+                    report(1,
+                           "ERROR: Need to allocate and copy string for new "
+                           "queue element");
+                    ok = false;
+                } else if (cnt > 1 &&
+                           list_entry(prev, element_t, list)->value ==
+                               cur_inserts) {
+                    report(1,
+                           "ERROR: Need to allocate separate string for each "
+                           "queue element");
+                    ok = false;
+                }
+            }
+            if (ok && r < reps) {
+                /* Element r could not be inserted */
+                r++;
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", inserts);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           inserts, fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
         }
-        bool ok = is_insert_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
+    }
+    exception_cancel();
+
+    show_queue(3);
+    return ok;
+}
+
+/*
+ * Run a constant-time check of simulation mode.  Without an argument the
+ * single-element operation is measured; when bulk is given, "cmd n" measures
+ * the bulk variant moving n elements per call instead.
+ */
+static bool simulate(int argc,
+                     char *argv[],
+                     bool (*single)(void),
+                     bool (*bulk)(int n))
+{
+    bool ok;
+    if (argc == 1) {
+        ok = single();
+    } else if (argc == 2 && bulk) {
+        int n;
+        if (!get_int(argv[1], &n) || n < 1 || n > DUT_MAX_BULK) {
+            report(1, "Invalid bulk size '%s' (expected 1 to %d)", argv[1],
+                   DUT_MAX_BULK);
             return false;
         }
-        report(1, "Probably constant time");
-        return ok;
+        ok = bulk(n);
+    } else {
+        if (bulk)
+            report(1, "%s takes 0-1 arguments in simulation mode", argv[0]);
+        else
+            report(1, "%s does not need arguments in simulation mode",
+                   argv[0]);
+        return false;
+    }
+
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time");
+        return false;
     }
+    report(1, "Probably constant time");
+    return ok;
+}
+
+/* insert head */
+static bool do_ih(int argc, char *argv[])
+{
+    if (simulation)
+        return simulate(argc, argv, is_insert_head_const,
+                        is_insert_head_bulk_const);
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RANDSTR_BUFSIZE];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -194,6 +469,9 @@ static bool do_ih(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    if (argc == 3)
+        return insert_bulk(true, inserts, need_rand, reps);
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
@@ -203,7 +481,7 @@ static bool do_ih(int argc, char *argv[])
                 lcnt++;
                 l_meta.size++;
                 char *cur_inserts =
-                    list_entry(l_meta.l->next, element_t, list)->value;
+                    list_entry(queue_end(true), element_t, list)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -244,21 +522,11 @@ static bool do_ih(int argc, char *argv[])
 /* insert tail */
 static bool do_it(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_insert_tail_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv, is_insert_tail_const,
+                        is_insert_tail_bulk_const);
 
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RANDSTR_BUFSIZE];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -283,6 +551,9 @@ static bool do_it(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    if (argc == 3)
+        return insert_bulk(false, inserts, need_rand, reps);
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
@@ -292,7 +563,7 @@ static bool do_it(int argc, char *argv[])
                 lcnt++;
                 l_meta.size++;
                 char *cur_inserts =
-                    list_entry(l_meta.l->prev, element_t, list)->value;
+                    list_entry(queue_end(false), element_t, list)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -316,6 +587,46 @@ static bool do_it(int argc, char *argv[])
     return ok;
 }
 
+/* Remove reps elements at once and compare each of them to checks */
+static bool remove_bulk(int option, char *checks, int reps)
+{
+    LIST_HEAD(removed);
+    int cnt = 0;
+    bool ok = true;
+
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    if (exception_setup(true))
+        cnt = option ? q_remove_tail_bulk(l_meta.l, &removed, reps)
+                     : q_remove_head_bulk(l_meta.l, &removed, reps);
+    exception_cancel();
+
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &removed, list) {
+        if (ok && strcmp(e->value, checks)) {
+            report(1, "ERROR: Removed value %s != expected value %s", e->value,
+                   checks);
+            ok = false;
+        }
+        q_release_element(e);
+    }
+    lcnt -= cnt;
+    l_meta.size -= cnt;
+    report(2, "Removed %d elements from queue", cnt);
+
+    if (cnt < reps) {
+        fail_count++;
+        report(1, "ERROR: Removal from queue failed (%d failures total)",
+               fail_count);
+        ok = false;
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
 static bool do_remove(int option, int argc, char *argv[])
 {
     // option 0 is for remove head; option 1 is for remove tail
@@ -326,25 +637,28 @@ static bool do_remove(int option, int argc, char *argv[])
      */
 #if !defined(__aarch64__)
     if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = option ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
+        if (option)
+            return simulate(argc, argv, is_remove_tail_const,
+                            is_remove_tail_bulk_const);
+        return simulate(argc, argv, is_remove_head_const,
+                        is_remove_head_bulk_const);
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc != 1 && argc != 2 && argc != 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 3) {
+        int reps;
+        if (!get_int(argv[2], &reps)) {
+            report(1, "Invalid number of removals '%s'", argv[2]);
+            return false;
+        }
+        return remove_bulk(option, argv[1], reps);
+    }
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -486,6 +800,163 @@ static bool do_rhq(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/*
+ * Remove head without copying and take its string over with q_take_value.
+ * A string allocated on its own must be handed over as is, and what comes
+ * back must be a block of its own, which is freed here.
+ */
+static bool do_rhz(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    bool ok = true;
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    element_t *re = NULL;
+    char *value = NULL;
+    size_t len = 0;
+    if (exception_setup(true))
+        re = q_remove_head(l_meta.l, NULL, 0);
+    exception_cancel();
+
+    if (!re) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removal failed");
+        } else {
+            report(1, "ERROR: Removal failed (%d failures total)", fail_count);
+            ok = false;
+        }
+        show_queue(3);
+        return ok && !error_check();
+    }
+    lcnt--;
+    l_meta.size--;
+
+    size_t slen = strlen(re->value);
+    if (re->len != slen) {
+        report(1, "ERROR: Element records length %zu for a string of %zu",
+               re->len, slen);
+        ok = false;
+    }
+    char *orig = re->value;
+    /* Strings inside the element or a loaded snapshot have to be copied */
+    bool borrowed = element_is_inline(re) || element_is_mapped(re);
+
+    if (exception_setup(true))
+        value = q_take_value(re, &len);
+    exception_cancel();
+
+    if (!value) {
+        q_release_element(re);
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Taking over removed value failed");
+        } else {
+            report(1, "ERROR: Taking over removed value failed (%d failures "
+                      "total)",
+                   fail_count);
+            ok = false;
+        }
+        show_queue(3);
+        return ok && !error_check();
+    }
+
+    if (!borrowed && value != orig) {
+        report(1, "ERROR: Removed value was copied instead of handed over");
+        ok = false;
+    } else if (borrowed && value == orig) {
+        report(1, "ERROR: Removed value still points into its element or "
+                  "snapshot");
+        ok = false;
+    } else if (len != slen || strlen(value) != slen) {
+        report(1, "ERROR: Removed value of length %zu came back with %zu",
+               slen, len);
+        ok = false;
+    } else if (argc == 2 && strcmp(value, argv[1])) {
+        report(1, "ERROR: Removed value %s != expected value %s", value,
+               argv[1]);
+        ok = false;
+    } else {
+        report(2, "Removed %s from queue", value);
+    }
+    /* The caller owns the string now; the harness checks it is a live block */
+    test_free(value);
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+struct dedup_key {
+    const char *value;
+    size_t idx;
+};
+
+static int dedup_key_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct dedup_key *) a)->value,
+                  ((const struct dedup_key *) b)->value);
+}
+
+/*
+ * Check the result of q_delete_dup_unsorted against l_copy, the queue as it
+ * was before the call.  Values occurring more than once are found by sorting
+ * a separate array of keys, so the queue itself may be in any order.  What
+ * remains must be the other values, in their original order.
+ */
+static bool check_dedup_unsorted(struct list_head *l_copy)
+{
+    size_t n = 0, i = 0;
+    element_t *item;
+    list_for_each_entry (item, l_copy, list)
+        n++;
+
+    /* One spare entry, so that an empty queue allocates as well */
+    struct dedup_key *keys = calloc(n + 1, sizeof(struct dedup_key));
+    bool *dup = calloc(n + 1, sizeof(bool));
+    if (!keys || !dup) {
+        free(keys);
+        free(dup);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for "
+               "duplicate checking");
+        return false;
+    }
+    list_for_each_entry (item, l_copy, list) {
+        keys[i].value = item->value;
+        keys[i].idx = i;
+        i++;
+    }
+    qsort(keys, n, sizeof(struct dedup_key), dedup_key_cmp);
+    for (i = 1; i < n; i++) {
+        if (strcmp(keys[i - 1].value, keys[i].value) == 0)
+            dup[keys[i - 1].idx] = dup[keys[i].idx] = true;
+    }
+
+    bool ok = true;
+    struct list_head *l_tmp = l_meta.l->next;
+    i = 0;
+    list_for_each_entry (item, l_copy, list) {
+        if (dup[i++]) {
+            lcnt--;
+            l_meta.size--;
+        } else if (l_tmp != l_meta.l &&
+                   strcmp(list_entry(l_tmp, element_t, list)->value,
+                          item->value) == 0)
+            l_tmp = l_tmp->next;
+        else
+            ok = false;
+    }
+    free(keys);
+    free(dup);
+    return ok && l_tmp == l_meta.l;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -496,6 +967,9 @@ static bool do_dedup(int argc, char *argv[])
     LIST_HEAD(l_copy);
     element_t *item, *tmp;
 
+    // The copy and the checks below walk the links in order
+    q_normalize(l_meta.l);
+
     // Copy l_meta.l to l_copy
     if (l_meta.l && !list_empty(l_meta.l)) {
         list_for_each_entry (item, l_meta.l, list) {
@@ -528,7 +1002,8 @@ static bool do_dedup(int argc, char *argv[])
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_dup(l_meta.l);
+        ok = dedup_unsorted ? q_delete_dup_unsorted(l_meta.l)
+                            : q_delete_dup(l_meta.l);
     exception_cancel();
 
     if (!ok) {
@@ -536,33 +1011,40 @@ static bool do_dedup(int argc, char *argv[])
             free(item->value);
             free(item);
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        if (l_meta.l)
+            report(1, "ERROR: Could not delete duplicates");
+        else
+            report(1, "ERROR: Calling delete duplicate on null queue");
         return false;
     }
 
-    struct list_head *l_tmp = l_meta.l->next;
-    bool is_this_dup = false;
-    // Compare between new list and old one
-    list_for_each_entry (item, &l_copy, list) {
-        // Skip comparison with new list if the string is duplicate
-        bool is_next_dup =
-            item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
-        if (is_this_dup || is_next_dup) {
-            // Update list size
-            lcnt--;
-            l_meta.size--;
-        } else if (l_tmp != l_meta.l &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
-            l_tmp = l_tmp->next;
-        else
-            ok = false;
-        is_this_dup = is_next_dup;
+    if (dedup_unsorted) {
+        ok = check_dedup_unsorted(&l_copy);
+    } else {
+        struct list_head *l_tmp = l_meta.l->next;
+        bool is_this_dup = false;
+        // Compare between new list and old one
+        list_for_each_entry (item, &l_copy, list) {
+            // Skip comparison with new list if the string is duplicate
+            bool is_next_dup =
+                item->list.next != &l_copy &&
+                strcmp(list_entry(item->list.next, element_t, list)->value,
+                       item->value) == 0;
+            if (is_this_dup || is_next_dup) {
+                // Update list size
+                lcnt--;
+                l_meta.size--;
+            } else if (l_tmp != l_meta.l &&
+                       strcmp(list_entry(l_tmp, element_t, list)->value,
+                              item->value) == 0)
+                l_tmp = l_tmp->next;
+            else
+                ok = false;
+            is_this_dup = is_next_dup;
+        }
+        // All elements in new list should be traversed
+        ok = ok && l_tmp == l_meta.l;
     }
-    // All elements in new list should be traversed
-    ok = ok && l_tmp == l_meta.l;
     if (!ok)
         report(1,
                "ERROR: Duplicate strings are in queue or distinct strings are "
@@ -600,6 +1082,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_size_const, NULL);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -647,6 +1132,49 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/*
+ * Sort the queue with the algorithm selected by option sort_algo, or
+ * externally once option spill_kb is set
+ */
+static bool sort_queue(struct list_head *l)
+{
+    if (spill_kb > 0)
+        return q_sort_external(l, (size_t) spill_kb * 1024, -1);
+    if (sort_algo == SORT_RADIX)
+        q_sort_radix(l);
+    else if (sort_threads > 1)
+        q_sort_parallel(l, sort_threads);
+    else
+        q_sort(l);
+    return true;
+}
+
+/*
+ * Check that the first cnt elements of the queue are in ascending order,
+ * reading the queue in the direction show_queue() does
+ */
+static bool check_sorted(int cnt)
+{
+    if (!l_meta.size)
+        return true;
+    bool forward = queue_forward();
+    for (struct list_head *cur_l = queue_end(true);
+         cur_l != l_meta.l && --cnt;
+         cur_l = forward ? cur_l->next : cur_l->prev) {
+        /* Ensure each element in ascending order */
+        /* FIXME: add an option to specify sorting order */
+        struct list_head *next_l = forward ? cur_l->next : cur_l->prev;
+        element_t *item, *next_item;
+        item = list_entry(cur_l, element_t, list);
+        next_item = list_entry(next_l, element_t, list);
+        if (strcmp(item->value, next_item->value) > 0) {
+            report(1, "ERROR: Not sorted in ascending order");
+            return false;
+        }
+    }
+    return true;
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -663,27 +1191,217 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    /* Spilled elements are freed and allocated again when merged back */
+    bool ok = true;
+    set_noallocate_mode(spill_kb == 0);
+    if (exception_setup(true))
+        ok = sort_queue(l_meta.l);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    if (!ok) {
+        report(1, "ERROR: External sort failed");
+        lcnt = l_meta.size = q_size(l_meta.l);
+        cnt = lcnt;
+    }
+    ok = check_sorted(cnt) && ok;
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Write the current queue to a snapshot file */
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l) {
+        report(3, "Warning: Calling save on null queue");
+        return !error_check();
+    }
+    error_check();
+
+    bool ok = false;
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_sort(l_meta.l);
+        ok = q_save(l_meta.l, argv[1]);
     exception_cancel();
     set_noallocate_mode(false);
 
-    bool ok = true;
-    if (l_meta.size) {
-        for (struct list_head *cur_l = l_meta.l->next;
-             cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
-            /* Ensure each element in ascending order */
-            /* FIXME: add an option to specify sorting order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (strcasecmp(item->value, next_item->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
-                break;
+    if (ok)
+        report(2, "Saved %d strings to %s", lcnt, argv[1]);
+    else
+        report(1, "ERROR: Could not save queue to %s", argv[1]);
+    return ok && !error_check();
+}
+
+/* Append the strings of a snapshot file to the tail of the current queue */
+static bool do_load(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l) {
+        report(3, "Warning: Calling load on null queue");
+        return !error_check();
+    }
+    error_check();
+
+    bool ok = false;
+    int before = q_size(l_meta.l);
+    if (exception_setup(true))
+        ok = q_load(l_meta.l, argv[1]);
+    exception_cancel();
+
+    int cnt = q_size(l_meta.l);
+    if (!ok) {
+        if (cnt != before) {
+            report(1, "ERROR: Failed load changed queue size from %d to %d",
+                   before, cnt);
+        } else {
+            fail_count++;
+            if (fail_count < fail_limit) {
+                report(2, "Loading %s failed", argv[1]);
+                ok = true;
+            } else {
+                report(1, "ERROR: Loading %s failed (%d failures total)",
+                       argv[1], fail_count);
             }
         }
+    } else {
+        report(2, "Loaded %d strings from %s", cnt - before, argv[1]);
+    }
+    lcnt = l_meta.size = cnt;
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/*
+ * Sort the queue externally into a file, one string per line, which empties
+ * the queue.  Without a file name, a temporary file is used.  The file is
+ * then read back to check that it holds every string in ascending order.
+ */
+static bool do_sortout(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l) {
+        report(3, "Warning: Calling sortout on null queue");
+        return !error_check();
+    }
+    error_check();
+
+    FILE *f = argc == 2 ? fopen(argv[1], "w+") : tmpfile();
+    if (!f) {
+        report(1, "ERROR: Could not open %s: %s",
+               argc == 2 ? argv[1] : "temporary file", strerror(errno));
+        return false;
+    }
+
+    int cnt = q_size(l_meta.l);
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_sort_external(l_meta.l, (size_t) spill_kb * 1024, fileno(f));
+    exception_cancel();
+
+    if (!ok)
+        report(1, "ERROR: External sort into file failed");
+    lcnt = l_meta.size = q_size(l_meta.l);
+    if (ok && lcnt != 0) {
+        report(1, "ERROR: %d elements left in queue after sortout", lcnt);
+        ok = false;
+    }
+
+    rewind(f);
+    char *line = NULL, *prev = NULL;
+    size_t cap = 0, prev_cap = 0;
+    ssize_t len;
+    int lines = 0;
+    while (ok && (len = getline(&line, &cap, f)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (prev && strcmp(prev, line) > 0) {
+            report(1, "ERROR: Not sorted in ascending order");
+            ok = false;
+        }
+        lines++;
+        /* Keep the previous line by swapping buffers */
+        char *tmp = prev;
+        size_t tmp_cap = prev_cap;
+        prev = line;
+        prev_cap = cap;
+        line = tmp;
+        cap = tmp_cap;
+    }
+    free(line);
+    free(prev);
+    fclose(f);
+
+    if (ok && lines != cnt) {
+        report(1, "ERROR: Wrote %d strings out of %d", lines, cnt);
+        ok = false;
+    }
+
+    if (ok)
+        report(2, "Wrote %d sorted strings", lines);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_merge(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling merge on null queue");
+    error_check();
+
+    save_current();
+    int total = 0;
+    queue_context_t *ctx, *first = NULL;
+    list_for_each_entry (ctx, &queue_chain, chain) {
+        total += ctx->size;
+        if (!first && ctx->q)
+            first = ctx;
+    }
+
+    int len = 0;
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        len = q_merge(&queue_chain);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    bool ok = true;
+    if (len != total) {
+        report(1, "ERROR: Merged queue holds %d elements, but should hold %d",
+               len, total);
+        ok = false;
+    }
+    /* All elements now belong to the first queue, which becomes current */
+    list_for_each_entry (ctx, &queue_chain, chain) {
+        ctx->size = ctx == first ? total : 0;
+        if (ctx != first && ctx->q && !list_empty(ctx->q)) {
+            report(1, "ERROR: Queue %d is not empty after merge", ctx->id);
+            ok = false;
+        }
+    }
+    if (first) {
+        current = NULL;
+        set_current(first);
+        ok = ok && check_sorted(total);
     }
 
     show_queue(3);
@@ -692,6 +1410,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_delete_mid_const, NULL);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -733,6 +1454,45 @@ static bool do_swap(int argc, char *argv[])
     return !error_check();
 }
 
+/* Run fn(l_meta.l, k) for the group operations reverseK and swapK */
+static bool do_group(void (*fn)(struct list_head *, int),
+                     int argc,
+                     char *argv[])
+{
+    int k;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &k) || k < 1) {
+        report(1, "Invalid group size '%s'", argv[1]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Try to access null queue");
+    error_check();
+
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        fn(l_meta.l, k);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    show_queue(3);
+    return !error_check();
+}
+
+static bool do_reverseK(int argc, char *argv[])
+{
+    return do_group(q_reverseK, argc, argv);
+}
+
+static bool do_swapK(int argc, char *argv[])
+{
+    return do_group(q_swapK, argc, argv);
+}
+
 static bool is_circular()
 {
     struct list_head *cur = l_meta.l->next;
@@ -771,7 +1531,8 @@ static bool show_queue(int vlevel)
     report_noreturn(vlevel, "l = [");
 
     struct list_head *ori = l_meta.l;
-    struct list_head *cur = l_meta.l->next;
+    bool forward = queue_forward();
+    struct list_head *cur = forward ? l_meta.l->next : l_meta.l->prev;
 
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < lcnt) {
@@ -779,7 +1540,7 @@ static bool show_queue(int vlevel)
             if (cnt < big_list_size)
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
             cnt++;
-            cur = cur->next;
+            cur = forward ? cur->next : cur->prev;
             ok = ok && !error_check();
         }
     }
@@ -810,7 +1571,19 @@ static bool do_show(int argc, char *argv[])
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
-    return show_queue(0);
+    if (queue_count < 2)
+        return show_queue(0);
+
+    bool ok = true;
+    queue_context_t *cur = current, *ctx;
+    list_for_each_entry (ctx, &queue_chain, chain) {
+        report_noreturn(0, "Queue %d%s: ", ctx->id,
+                        ctx == cur ? " (current)" : "");
+        set_current(ctx);
+        ok = show_queue(0) && ok;
+    }
+    set_current(cur);
+    return ok;
 }
 
 struct list_head *list_node_at(struct list_head *head, int index)
@@ -820,14 +1593,46 @@ struct list_head *list_node_at(struct list_head *head, int index)
     return head;
 }
 
+/*
+ * Fisher-Yates shuffle over an array of the nodes, relinked in their new
+ * order afterwards.  Should the array not fit in memory, fall back to moving
+ * random nodes to the tail one by one, which takes quadratic time.
+ */
 void q_shuffle(struct list_head *head)
 {
     if (head == NULL || list_empty(head) || list_is_singular(head))
         return;
-    srand(time(NULL));
-    for (int i = q_size(head); i > 1; i--) {
-        list_move_tail(list_node_at(head, rand() % i), head);
+
+    int n = q_size(head);
+    struct list_head **nodes = malloc(n * sizeof(*nodes));
+    if (!nodes) {
+        for (int i = n; i > 1; i--)
+            list_move_tail(list_node_at(head, prng_below(i)), head);
+        q_reordered(head);
+        return;
+    }
+
+    struct list_head *node;
+    int i = 0;
+    list_for_each (node, head)
+        nodes[i++] = node;
+    for (i = n - 1; i > 0; i--) {
+        int j = prng_below(i + 1);
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+
+    struct list_head *prev = head;
+    for (i = 0; i < n; i++) {
+        prev->next = nodes[i];
+        nodes[i]->prev = prev;
+        prev = nodes[i];
     }
+    prev->next = head;
+    head->prev = prev;
+    free(nodes);
+    q_reordered(head);
 }
 
 static bool do_shuffle(int argc, char *argv[])
@@ -856,10 +1661,328 @@ static bool do_shuffle(int argc, char *argv[])
     return !error_check();
 }
 
+/* Print the block deque like show_queue() does the list */
+static void show_bqueue(int vlevel)
+{
+    if (verblevel < vlevel)
+        return;
+    if (!bq) {
+        report(vlevel, "b = NULL");
+        return;
+    }
+    size_t n = bq_size(bq);
+    report_noreturn(vlevel, "b = [");
+    for (size_t i = 0; i < n && i < (size_t) big_list_size; i++)
+        report_noreturn(vlevel, i == 0 ? "%s" : " %s", bq_at(bq, i));
+    report(vlevel, n > (size_t) big_list_size ? " ... ]" : "]");
+}
+
+/* Insert reps copies of inserts, or random strings for RAND */
+static bool bq_insert(bool at_head, char *inserts, int reps)
+{
+    char randstr_buf[RANDSTR_BUFSIZE];
+    bool need_rand = !strcmp(inserts, "RAND");
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (need_rand) {
+                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = randstr_buf;
+            }
+            ok = at_head ? bq_insert_head(bq, inserts)
+                         : bq_insert_tail(bq, inserts);
+            if (!ok)
+                report(1, "ERROR: Insertion of %s failed", inserts);
+        }
+    }
+    exception_cancel();
+    return ok;
+}
+
+/* Remove reps elements, comparing each of them to checks if not NULL */
+static bool bq_remove(bool at_head, char *checks, int reps)
+{
+    char removes[RANDSTR_BUFSIZE];
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            ok = at_head ? bq_remove_head(bq, removes, sizeof(removes))
+                         : bq_remove_tail(bq, removes, sizeof(removes));
+            if (!ok) {
+                report(1, "ERROR: Removal from empty queue");
+            } else if (checks && strcmp(removes, checks)) {
+                report(1, "ERROR: Removed value %s != expected value %s",
+                       removes, checks);
+                ok = false;
+            } else {
+                report(2, "Removed %s from queue", removes);
+            }
+        }
+    }
+    exception_cancel();
+    return ok;
+}
+
+static bool do_bq(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs an operation", argv[0]);
+        return false;
+    }
+
+    char *op = argv[1];
+    int reps = 1;
+    bool ok = true;
+    bool insert = !strcmp(op, "ih") || !strcmp(op, "it");
+    bool remove = !strcmp(op, "rh") || !strcmp(op, "rt");
+    if (insert || remove) {
+        if (argc > 4 || (insert && argc < 3)) {
+            report(1, "%s %s needs %s arguments", argv[0], op,
+                   insert ? "1-2" : "0-2");
+            return false;
+        }
+        if (argc == 4 && !get_int(argv[3], &reps)) {
+            report(1, "Invalid number of repetitions '%s'", argv[3]);
+            return false;
+        }
+    } else if (argc != 2) {
+        report(1, "%s %s takes no arguments", argv[0], op);
+        return false;
+    }
+
+    if (!strcmp(op, "new") || !strcmp(op, "free")) {
+        if (exception_setup(true)) {
+            bq_free(bq);
+            bq = op[0] == 'n' ? bq_new() : NULL;
+        }
+        exception_cancel();
+        if (op[0] == 'n' && !bq) {
+            report(1, "ERROR: Could not create block deque");
+            ok = false;
+        }
+        size_t bcnt = leaked_blocks();
+        if (bcnt > 0) {
+            report(1,
+                   "ERROR: Freed block deque, but %lu blocks are still "
+                   "allocated",
+                   bcnt);
+            ok = false;
+        }
+        show_bqueue(3);
+        return ok && !error_check();
+    }
+
+    if (!bq) {
+        report(1, "ERROR: No block deque, create one with '%s new'", argv[0]);
+        return false;
+    }
+
+    if (insert) {
+        ok = bq_insert(op[1] == 'h', argv[2], reps);
+    } else if (remove) {
+        ok = bq_remove(op[1] == 'h', argc > 2 ? argv[2] : NULL, reps);
+    } else if (!strcmp(op, "size")) {
+        report(2, "Queue size = %zu", bq_size(bq));
+    } else if (!strcmp(op, "show")) {
+        show_bqueue(0);
+        return true;
+    } else if (!strcmp(op, "sort") || !strcmp(op, "dedup")) {
+        bool sort = op[0] == 's';
+        if (exception_setup(true)) {
+            if (sort)
+                ok = bq_sort(bq);
+            else
+                bq_delete_dup(bq);
+        }
+        exception_cancel();
+        size_t n = bq_size(bq);
+        for (size_t i = 1; ok && i < n; i++) {
+            int c = strcmp(bq_at(bq, i - 1), bq_at(bq, i));
+            if (c > 0 || (c == 0 && !sort)) {
+                report(1, sort ? "ERROR: Not sorted in ascending order"
+                               : "ERROR: Duplicate strings are left");
+                ok = false;
+            }
+        }
+    } else {
+        bool known = true;
+        if (exception_setup(true)) {
+            if (!strcmp(op, "reverse"))
+                bq_reverse(bq);
+            else if (!strcmp(op, "swap"))
+                bq_swap(bq);
+            else if (!strcmp(op, "shuffle"))
+                bq_shuffle(bq);
+            else if (!strcmp(op, "dm"))
+                ok = bq_delete_mid(bq);
+            else
+                known = false;
+        }
+        exception_cancel();
+        if (!known) {
+            report(1, "Unknown operation '%s %s'", argv[0], op);
+            return false;
+        }
+    }
+
+    show_bqueue(3);
+    return ok && !error_check();
+}
+
+/* State shared by the threads of do_mpmc */
+typedef struct {
+    cqueue_t *q;
+    int producers;
+    /* Elements inserted by each producer */
+    int per_producer;
+    atomic_int consumed;
+    atomic_bool failed;
+} mpmc_t;
+
+typedef struct {
+    mpmc_t *m;
+    int id;
+} mpmc_arg_t;
+
+#define MPMC_STRLEN 24
+
+static void *mpmc_producer(void *arg)
+{
+    mpmc_arg_t *a = arg;
+    mpmc_t *m = a->m;
+    char buf[MPMC_STRLEN];
+    for (int i = 0; i < m->per_producer && !atomic_load(&m->failed); i++) {
+        snprintf(buf, sizeof(buf), "%d:%d", a->id, i);
+        if (!cq_insert_tail(m->q, buf))
+            atomic_store(&m->failed, true);
+    }
+    return NULL;
+}
+
+/*
+ * Elements of each producer must come out in the order they went in, so
+ * every consumer checks that the sequence numbers it sees keep increasing.
+ */
+static void *mpmc_consumer(void *arg)
+{
+    mpmc_arg_t *a = arg;
+    mpmc_t *m = a->m;
+    int total = m->producers * m->per_producer;
+    int *last = malloc(m->producers * sizeof(int));
+    if (!last) {
+        atomic_store(&m->failed, true);
+        return NULL;
+    }
+    for (int i = 0; i < m->producers; i++)
+        last[i] = -1;
+
+    char buf[MPMC_STRLEN];
+    while (atomic_load(&m->consumed) < total && !atomic_load(&m->failed)) {
+        if (!cq_remove_head(m->q, buf, sizeof(buf))) {
+            sched_yield();
+            continue;
+        }
+        int p, seq;
+        if (sscanf(buf, "%d:%d", &p, &seq) != 2 || p < 0 ||
+            p >= m->producers || seq <= last[p]) {
+            atomic_store(&m->failed, true);
+            break;
+        }
+        last[p] = seq;
+        atomic_fetch_add(&m->consumed, 1);
+    }
+    free(last);
+    return NULL;
+}
+
+static bool do_mpmc(int argc, char *argv[])
+{
+    int kind, producers, consumers, n;
+    if (argc != 5) {
+        report(1, "%s needs 4 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &kind) || (kind != CQ_TWO_LOCK &&
+                                     kind != CQ_LOCK_FREE)) {
+        report(1, "Invalid queue kind '%s'", argv[1]);
+        return false;
+    }
+    if (!get_int(argv[2], &producers) || producers < 1 ||
+        !get_int(argv[3], &consumers) || consumers < 1 ||
+        !get_int(argv[4], &n) || n < 0) {
+        report(1, "Invalid thread or element count");
+        return false;
+    }
+
+    mpmc_t m;
+    m.q = cq_new(kind);
+    m.producers = producers;
+    m.per_producer = n / producers;
+    atomic_init(&m.consumed, 0);
+    atomic_init(&m.failed, false);
+
+    int nthreads = producers + consumers;
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    mpmc_arg_t *args = malloc(nthreads * sizeof(mpmc_arg_t));
+    if (!m.q || !tids || !args) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for threads");
+        cq_free(m.q);
+        free(tids);
+        free(args);
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        args[i].m = &m;
+        args[i].id = i < producers ? i : i - producers;
+        if (pthread_create(&tids[i], NULL,
+                           i < producers ? mpmc_producer : mpmc_consumer,
+                           &args[i])) {
+            atomic_store(&m.failed, true);
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    bool ok = !atomic_load(&m.failed) && !cq_remove_head(m.q, NULL, 0);
+    int total = m.producers * m.per_producer;
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    if (ok) {
+        report(1,
+               "%s queue, %d producers, %d consumers: %d elements in %.3f s, "
+               "%.0f ops/sec",
+               kind == CQ_LOCK_FREE ? "Lock-free" : "Two-lock", producers,
+               consumers, total, elapsed,
+               elapsed > 0 ? 2 * total / elapsed : 0);
+    } else {
+        report(1, "ERROR: Concurrent queue lost, duplicated or reordered "
+                  "elements");
+    }
+
+    cq_free(m.q);
+    free(tids);
+    free(args);
+    return ok;
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "                | Create new queue");
-    ADD_COMMAND(free, "                | Delete queue");
+    ADD_COMMAND(new, "                | Create new queue and make it current");
+    ADD_COMMAND(free,
+                "                | Delete current queue and make the "
+                "previous one current");
+    ADD_COMMAND(prev, "                | Make the previous queue current");
+    ADD_COMMAND(next, "                | Make the next queue current");
+    ADD_COMMAND(merge,
+                "                | Merge all sorted queues into the first "
+                "one");
     ADD_COMMAND(
         ih,
         " str [n]        | Insert string str at head of queue n times. "
@@ -870,33 +1993,91 @@ static void console_init()
         "Generate random string(s) if str equals RAND. (default: n == 1)");
     ADD_COMMAND(
         rh,
-        " [str]          | Remove from head of queue.  Optionally compare "
-        "to expected value str");
+        " [str [n]]      | Remove from head of queue (n times).  Optionally "
+        "compare to expected value str");
     ADD_COMMAND(
         rt,
-        " [str]          | Remove from tail of queue.  Optionally compare "
-        "to expected value str");
+        " [str [n]]      | Remove from tail of queue (n times).  Optionally "
+        "compare to expected value str");
     ADD_COMMAND(
         rhq,
         "                | Remove from head of queue without reporting value.");
+    ADD_COMMAND(rhz,
+                " [str]          | Remove from head of queue without copying "
+                "and take over its string.  Optionally compare to expected "
+                "value str");
     ADD_COMMAND(reverse, "                | Reverse queue");
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
+    ADD_FILE_COMMAND(save, " file           | Save queue to snapshot file");
+    ADD_FILE_COMMAND(load,
+                     " file           | Append strings of snapshot file to "
+                     "tail of queue");
+    ADD_FILE_COMMAND(sortout,
+                     " [file]         | Sort queue into file, one string per "
+                     "line, emptying the queue.  (default: a temporary file)");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
-    ADD_COMMAND(show, "                | Show queue contents");
+    ADD_COMMAND(show, "                | Show contents of all queues");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
     ADD_COMMAND(
         dedup, "                | Delete all nodes that have duplicate string");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
+    ADD_COMMAND(reverseK,
+                " k              | Reverse the nodes of the queue k at a time");
+    ADD_COMMAND(swapK,
+                " k              | Swap every two adjacent groups of k nodes");
     ADD_COMMAND(shuffle,
                 "                | Perform Fisher-Yates shuffle in queue");
+    ADD_COMMAND(bq,
+                " op [args]      | Run op on a deque of fixed-size blocks: "
+                "new, free, ih/it str [n], rh/rt [str [n]], size, show, "
+                "reverse, swap, sort, dedup, dm or shuffle");
+    ADD_COMMAND(mpmc,
+                " kind p c n     | Pass n strings from p producer to c "
+                "consumer threads through a concurrent queue (kind 0: "
+                "two-lock, 1: lock-free)");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("seed", &seed,
+              "Seed the random generator of RAND strings, shuffle and dudect",
+              seed_changed);
+    add_param("rand_min", &rand_min, "Minimum length of RAND strings", NULL);
+    add_param("rand_max", &rand_max, "Maximum length of RAND strings", NULL);
+    add_param("harness", &harness_mode,
+              "Allocation checks (0: full, 1: fast, sampling 1 block in 64)",
+              NULL);
+    add_param("time_limit", &time_limit,
+              "Seconds each queue operation may take (0: no limit)", NULL);
+    add_param("pool", &use_pool, "Allocate elements of new queues from a pool",
+              NULL);
+    add_param("sort_algo", &sort_algo,
+              "Sorting algorithm (0: merge sort, 1: MSD radix sort)", NULL);
+    add_param("sort_threads", &sort_threads,
+              "Number of threads used by merge sort", NULL);
+    add_param("spill_kb", &spill_kb,
+              "KiB of elements sort keeps in memory before spilling to disk "
+              "(0: no limit)",
+              NULL);
+    add_param("dedup_unsorted", &dedup_unsorted,
+              "Use hash-based dedup, which does not need a sorted queue", NULL);
+    add_param("dudect_measure", &dudect_measure,
+              "Executions per constant-time measurement batch", NULL);
+    add_param("dudect_enough", &dudect_enough,
+              "Measurements before a constant-time verdict", NULL);
+    add_param("dudect_threshold", &dudect_threshold,
+              "Largest t statistic deemed constant time", NULL);
+    add_param("dudect_workers", &dudect_workers,
+              "Processes running constant-time measurements (0: one per CPU, "
+              "at most 8)",
+              NULL);
+    add_param("dudect_full", &dudect_full,
+              "Fail constant-time checks on any cropped or second order test",
+              NULL);
 }
 
 /* Signal handlers */
@@ -924,16 +2105,28 @@ static void queue_init()
     signal(SIGALRM, sigalrmhandler);
 }
 
+/* Free every queue and the block deque */
+static void free_queues(void)
+{
+    queue_context_t *ctx, *tmp;
+    set_current(NULL);
+    if (exception_setup(true)) {
+        list_for_each_entry (ctx, &queue_chain, chain)
+            q_free(ctx->q);
+        bq_free(bq);
+    }
+    exception_cancel();
+    bq = NULL;
+    list_for_each_entry_safe (ctx, tmp, &queue_chain, chain)
+        free(ctx);
+    INIT_LIST_HEAD(&queue_chain);
+    queue_count = 0;
+}
+
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-
-    if (exception_setup(true))
-        q_free(l_meta.l);
-    exception_cancel();
-    set_cautious_mode(true);
+    free_queues();
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -945,13 +2138,90 @@ static bool queue_quit(int argc, char *argv[])
     return true;
 }
 
+/* Hooks of the server, which swap the state of sessions in and out */
+static void *session_open(void)
+{
+    session_state_t *st = malloc(sizeof(session_state_t));
+    if (!st)
+        return NULL;
+    INIT_LIST_HEAD(&st->chain);
+    st->current = NULL;
+    st->queue_count = 0;
+    st->next_queue_id = 0;
+    st->bq = NULL;
+    st->parked = false;
+    return st;
+}
+
+static void session_enter(void *state)
+{
+    session_state_t *st = state;
+    list_splice_init(&st->chain, &queue_chain);
+    current = NULL;
+    set_current(st->current);
+    queue_count = st->queue_count;
+    next_queue_id = st->next_queue_id;
+    bq = st->bq;
+    if (st->parked) {
+        st->parked = false;
+        parked_sessions--;
+    }
+}
+
+static void session_leave(void *state)
+{
+    session_state_t *st = state;
+    save_current();
+    st->current = current;
+    current = NULL;
+    l_meta.l = NULL;
+    l_meta.size = 0;
+    lcnt = 0;
+    list_splice_init(&queue_chain, &st->chain);
+    st->queue_count = queue_count;
+    st->next_queue_id = next_queue_id;
+    st->bq = bq;
+    queue_count = next_queue_id = 0;
+    bq = NULL;
+    if (!list_empty(&st->chain) || st->bq) {
+        st->parked = true;
+        parked_sessions++;
+    }
+}
+
+static void session_close(void *state)
+{
+    free_queues();
+    next_queue_id = 0;
+    free(state);
+
+    size_t bcnt = allocation_check();
+    if (bcnt > 0 && parked_sessions == 0)
+        report(1, "ERROR: Closed session, but %lu blocks are still allocated",
+               bcnt);
+}
+
+static const session_ops_t session_ops = {
+    .open = session_open,
+    .enter = session_enter,
+    .leave = session_leave,
+    .close = session_close,
+};
+
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-s ADDR][-u PATH]"
+        "[-F]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-s ADDR    Serve sessions of commands on TCP [HOST:]PORT\n");
+    printf("\t           (HOST: loopback if left out, * for all addresses)\n");
+    printf("\t-u PATH    Serve sessions of commands on Unix socket PATH\n");
+    printf("\t-F         Let sessions run commands that open files\n");
     exit(0);
 }
 
@@ -1000,10 +2270,13 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *port = NULL;
+    char *sock_path = NULL;
+    bool session_files = false;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:s:u:F")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1028,6 +2301,15 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 's':
+            port = optarg;
+            break;
+        case 'u':
+            sock_path = optarg;
+            break;
+        case 'F':
+            session_files = true;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1039,9 +2321,16 @@ int main(int argc, char *argv[])
     queue_init();
     init_cmd();
     console_init();
+    set_session_files(session_files);
+
+    bool serve = port || sock_path;
+    if (serve && infile_name) {
+        fprintf(stderr, "Cannot read commands from a file while serving\n");
+        exit(EXIT_FAILURE);
+    }
 
     /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    if (!infile_name && !serve) {
         /* Trigger call back function(auto completion) */
         linenoiseSetCompletionCallback(completion);
 
@@ -1059,7 +2348,10 @@ int main(int argc, char *argv[])
     add_quit_helper(queue_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (serve)
+        ok = ok && run_server(port, sock_path, &session_ops);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
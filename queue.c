@@ -1,8 +1,16 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "harness.h"
 #include "queue.h"
@@ -19,11 +27,169 @@
  */
 struct list_head *q_new()
 {
-    struct list_head *q = malloc(sizeof(struct list_head));
+    queue_t *q = malloc(sizeof(queue_t));
     if (q == NULL)
         return NULL;
-    INIT_LIST_HEAD(q);
-    return q;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->mid = NULL;
+    q->pool = NULL;
+    q->reversed = false;
+    return &q->head;
+}
+
+/*
+ * Element pool.
+ *
+ * Elements are carved from chunks whose size doubles up to POOL_MAX_SLOTS,
+ * and released ones are kept on a free list linked through list.next.
+ * Chunks come from malloc, so the harness still accounts for every byte the
+ * pool holds.
+ */
+#define POOL_MIN_SLOTS 256
+#define POOL_MAX_SLOTS 65536
+
+struct pool_chunk {
+    struct pool_chunk *next;
+    size_t nslots;
+    element_t slots[];
+};
+
+struct q_pool {
+    /* Newest chunk first; slots past used in it were never handed out */
+    struct pool_chunk *chunks;
+    size_t used;
+    struct list_head *free_list;
+    /* Slots handed out and not yet released */
+    size_t live;
+    /* Owning queue has been freed */
+    bool orphan;
+    /* Snapshot mapped by q_load() that the strings of the slots point into */
+    char *map;
+    size_t map_len;
+};
+
+static element_t *pool_get(struct q_pool *pool)
+{
+    element_t *e;
+    if (pool->free_list) {
+        e = list_entry(pool->free_list, element_t, list);
+        pool->free_list = pool->free_list->next;
+    } else {
+        struct pool_chunk *c = pool->chunks;
+        if (c == NULL || pool->used == c->nslots) {
+            size_t n = c ? c->nslots * 2 : POOL_MIN_SLOTS;
+            if (n > POOL_MAX_SLOTS)
+                n = POOL_MAX_SLOTS;
+            c = malloc(sizeof(struct pool_chunk) + n * sizeof(element_t));
+            if (c == NULL)
+                return NULL;
+            c->nslots = n;
+            c->next = pool->chunks;
+            pool->chunks = c;
+            pool->used = 0;
+        }
+        e = &c->slots[pool->used++];
+    }
+    e->pool = pool;
+    pool->live++;
+    return e;
+}
+
+static void pool_destroy(struct q_pool *pool)
+{
+    struct pool_chunk *c = pool->chunks;
+    while (c) {
+        struct pool_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    if (pool->map)
+        munmap(pool->map, pool->map_len);
+    free(pool);
+}
+
+static void pool_put(element_t *e)
+{
+    struct q_pool *pool = e->pool;
+    e->list.next = pool->free_list;
+    pool->free_list = &e->list;
+    if (--pool->live == 0 && pool->orphan)
+        pool_destroy(pool);
+}
+
+struct list_head *q_new_pool()
+{
+    struct q_pool *pool = malloc(sizeof(struct q_pool));
+    if (pool == NULL)
+        return NULL;
+    struct list_head *head = q_new();
+    if (head == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->chunks = NULL;
+    pool->used = 0;
+    pool->free_list = NULL;
+    pool->live = 0;
+    pool->orphan = false;
+    pool->map = NULL;
+    pool->map_len = 0;
+    q_desc(head)->pool = pool;
+    return head;
+}
+
+/* Give the element back to wherever it was allocated from */
+static void element_free(element_t *e)
+{
+    if (e->pool)
+        pool_put(e);
+    else
+        free(e);
+}
+
+/* Key of the string s of length len, see element_t */
+static inline uint64_t str_key(const char *s, size_t len)
+{
+    uint64_t key = 0;
+    memcpy(&key, s, len < 8 ? len : 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    key = __builtin_bswap64(key);
+#endif
+    return key;
+}
+
+/*
+ * Allocate an element holding a copy of s, from the pool if q has one.
+ * Short strings are copied into the element itself.
+ */
+static element_t *element_new(queue_t *q, const char *s)
+{
+    element_t *e;
+    if (q->pool) {
+        e = pool_get(q->pool);
+    } else {
+        e = malloc(sizeof(element_t));
+        if (e)
+            e->pool = NULL;
+    }
+    if (e == NULL)
+        return NULL;
+
+    size_t len = strlen(s) + 1;
+    e->len = len - 1;
+    e->key = str_key(s, e->len);
+    if (len <= ELEMENT_INLINE_LEN) {
+        e->value = memcpy(e->inline_value, s, len);
+        return e;
+    }
+    e->value = malloc(len);
+    if (e->value == NULL) {
+        element_free(e);
+        return NULL;
+    }
+    memcpy(e->value, s, len);
+    return e;
 }
 
 /* Free all storage used by queue */
@@ -35,32 +201,147 @@ void q_free(struct list_head *l)
     list_for_each_entry_safe (e, s, l, list) {
         q_release_element(e);
     }
-    free(l);
+    queue_t *q = q_desc(l);
+    if (q->pool) {
+        q->pool->orphan = true;
+        if (q->pool->live == 0)
+            pool_destroy(q->pool);
+    }
+    free(q);
 }
 
 /*
- * Attempt to insert element at head of queue.
- * Return true if successful.
- * Return false if q is NULL or could not allocate space.
- * Argument s points to the string to be stored.
- * The function must explicitly allocate space and copy the string into it.
+ * Keeping track of the middle node.
+ *
+ * q->mid is the node at index size / 2.  Inserting or removing at either end
+ * moves that index by at most one position, so the cursor can be adjusted
+ * with a single pointer step.  The helpers below expect the size to still
+ * hold the old count; insertions call them after linking the new node and
+ * removals before unlinking the old one.
+ * Operations that rearrange the whole list just drop the cursor, and it is
+ * recomputed by the next q_delete_mid().
+ * Indices here count along the links, whichever way q->reversed says the
+ * queue is read.
  */
-bool q_insert_head(struct list_head *head, char *s)
+static inline void mid_on_insert_head(queue_t *q, struct list_head *node)
+{
+    if (q->size == 0)
+        q->mid = node;
+    else if (q->mid && !(q->size & 1))
+        q->mid = q->mid->prev;
+}
+
+static inline void mid_on_insert_tail(queue_t *q, struct list_head *node)
+{
+    if (q->size == 0)
+        q->mid = node;
+    else if (q->mid && (q->size & 1))
+        q->mid = q->mid->next;
+}
+
+static inline void mid_on_remove_head(queue_t *q)
+{
+    if (q->size == 1)
+        q->mid = NULL;
+    else if (q->mid && (q->size & 1))
+        q->mid = q->mid->next;
+}
+
+static inline void mid_on_remove_tail(queue_t *q)
+{
+    if (q->size == 1)
+        q->mid = NULL;
+    else if (q->mid && !(q->size & 1))
+        q->mid = q->mid->prev;
+}
+
+/* Move the middle cursor by delta nodes, if it is known */
+static void mid_move(queue_t *q, int delta)
+{
+    if (q->mid == NULL)
+        return;
+    for (; delta > 0; delta--)
+        q->mid = q->mid->next;
+    for (; delta < 0; delta++)
+        q->mid = q->mid->prev;
+}
+
+/* Return the middle node, walking the list only if the cursor was dropped */
+static struct list_head *q_get_mid(queue_t *q)
+{
+    if (q->mid == NULL) {
+        struct list_head *node = q->head.next;
+        for (int i = q->size / 2; i > 0; i--)
+            node = node->next;
+        q->mid = node;
+    }
+    return q->mid;
+}
+
+void q_reordered(struct list_head *head)
+{
+    if (head == NULL)
+        return;
+    q_desc(head)->mid = NULL;
+}
+
+/* Swap the links of every node of the list, its head included */
+static void reverse_links(struct list_head *head)
+{
+    struct list_head *n, *s;
+    list_for_each_safe (n, s, head) {
+        n->next = n->prev;
+        n->prev = s;
+    }
+    struct list_head *tmp;
+    tmp = head->next;
+    head->next = head->prev;
+    head->prev = tmp;
+}
+
+void q_normalize(struct list_head *head)
+{
+    if (head == NULL || !q_desc(head)->reversed)
+        return;
+    queue_t *q = q_desc(head);
+    q->reversed = false;
+    /* For even n, index n / 2 maps to n / 2 - 1 */
+    if (q->mid && !(q->size & 1))
+        q->mid = q->mid->prev;
+    reverse_links(head);
+}
+
+static bool insert_one(struct list_head *head, char *s, bool at_head)
 {
     if (head == NULL)
         return false;
-    element_t *new = malloc(sizeof(element_t));
+    queue_t *q = q_desc(head);
+    element_t *new = element_new(q, s);
     if (new == NULL)
         return false;
-    new->value = strdup(s);
-    if (new->value == NULL) {
-        free(new);
-        return false;
+    if (at_head != q->reversed) {
+        list_add(&new->list, head);
+        mid_on_insert_head(q, &new->list);
+    } else {
+        list_add_tail(&new->list, head);
+        mid_on_insert_tail(q, &new->list);
     }
-    list_add(&new->list, head);
+    q->size++;
     return true;
 }
 
+/*
+ * Attempt to insert element at head of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ * Argument s points to the string to be stored.
+ * The function must explicitly allocate space and copy the string into it.
+ */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    return insert_one(head, s, true);
+}
+
 /*
  * Attempt to insert element at tail of queue.
  * Return true if successful.
@@ -70,18 +351,112 @@ bool q_insert_head(struct list_head *head, char *s)
  */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    if (head == NULL)
-        return false;
-    element_t *new = malloc(sizeof(element_t));
-    if (new == NULL)
-        return false;
-    new->value = strdup(s);
-    if (new->value == NULL) {
-        free(new);
-        return false;
+    return insert_one(head, s, false);
+}
+
+/*
+ * Build a detached chain of up to n new elements, taking the strings from sv
+ * or gen.  For head insertion the chain is built in reverse, which matches
+ * inserting the strings one by one.
+ * Return the number of elements in the chain.
+ */
+static int chain_build(queue_t *q,
+                       struct list_head *chain,
+                       char **sv,
+                       q_gen_t gen,
+                       void *arg,
+                       int n,
+                       bool reverse)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        element_t *e = element_new(q, sv ? sv[i] : gen(arg, i));
+        if (e == NULL)
+            break;
+        if (reverse)
+            list_add(&e->list, chain);
+        else
+            list_add_tail(&e->list, chain);
     }
-    list_add_tail(&new->list, head);
-    return true;
+    return i;
+}
+
+static int insert_bulk(struct list_head *head,
+                       char **sv,
+                       q_gen_t gen,
+                       void *arg,
+                       int n,
+                       bool at_head)
+{
+    if (head == NULL || n <= 0)
+        return 0;
+    queue_t *q = q_desc(head);
+    /* In a reversed queue, the head end is at head->prev */
+    at_head = at_head != q->reversed;
+    LIST_HEAD(chain);
+    int cnt = chain_build(q, &chain, sv, gen, arg, n, at_head);
+    if (cnt == 0)
+        return 0;
+
+    if (q->size == 0) {
+        list_splice(&chain, head);
+        q->mid = NULL;
+    } else if (at_head) {
+        list_splice(&chain, head);
+        /* The old middle moved cnt places right of its old index */
+        mid_move(q, (q->size + cnt) / 2 - q->size / 2 - cnt);
+    } else {
+        list_splice_tail(&chain, head);
+        mid_move(q, (q->size + cnt) / 2 - q->size / 2);
+    }
+    q->size += cnt;
+    return cnt;
+}
+
+int q_insert_head_bulk(struct list_head *head, char **sv, int n)
+{
+    return insert_bulk(head, sv, NULL, NULL, n, true);
+}
+
+int q_insert_tail_bulk(struct list_head *head, char **sv, int n)
+{
+    return insert_bulk(head, sv, NULL, NULL, n, false);
+}
+
+int q_insert_head_gen(struct list_head *head, q_gen_t gen, void *arg, int n)
+{
+    return insert_bulk(head, NULL, gen, arg, n, true);
+}
+
+int q_insert_tail_gen(struct list_head *head, q_gen_t gen, void *arg, int n)
+{
+    return insert_bulk(head, NULL, gen, arg, n, false);
+}
+
+static element_t *remove_one(struct list_head *head,
+                             char *sp,
+                             size_t bufsize,
+                             bool at_head)
+{
+    if (head == NULL || list_empty(head))
+        return NULL;
+    queue_t *q = q_desc(head);
+    element_t *ele;
+    if (at_head != q->reversed) {
+        ele = list_entry(head->next, element_t, list);
+        mid_on_remove_head(q);
+    } else {
+        ele = list_entry(head->prev, element_t, list);
+        mid_on_remove_tail(q);
+    }
+    list_del_init(&ele->list);
+    q->size--;
+    if (sp != NULL) {
+        size_t n = ele->len < bufsize - 1 ? ele->len : bufsize - 1;
+        memcpy(sp, ele->value, n);
+        sp[n] = '\0';
+    }
+    return ele;
 }
 
 /*
@@ -100,15 +475,7 @@ bool q_insert_tail(struct list_head *head, char *s)
  */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (head == NULL || list_empty(head))
-        return NULL;
-    element_t *ele = list_entry(head->next, element_t, list);
-    list_del_init(&ele->list);
-    if (sp != NULL) {
-        strncpy(sp, ele->value, bufsize - 1);
-        *(sp + bufsize - 1) = '\0';
-    }
-    return ele;
+    return remove_one(head, sp, bufsize, true);
 }
 
 /*
@@ -117,15 +484,74 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (head == NULL || list_empty(head))
-        return NULL;
-    element_t *ele = list_entry(head->prev, element_t, list);
-    list_del_init(&ele->list);
-    if (sp != NULL) {
-        strncpy(sp, ele->value, bufsize - 1);
-        *(sp + bufsize - 1) = '\0';
+    return remove_one(head, sp, bufsize, false);
+}
+
+/* Move n nodes, 0 < n, from the link head or tail of head to the tail of out */
+static int remove_links(struct list_head *head,
+                        struct list_head *out,
+                        int n,
+                        bool at_head)
+{
+    queue_t *q = q_desc(head);
+    if (n >= q->size) {
+        n = q->size;
+        list_splice_tail_init(head, out);
+        q->size = 0;
+        q->mid = NULL;
+        return n;
     }
-    return ele;
+
+    /* Old index i becomes i - n when removing from the head */
+    LIST_HEAD(cut);
+    struct list_head *node;
+    if (at_head) {
+        mid_move(q, n + (q->size - n) / 2 - q->size / 2);
+        node = head;
+        for (int i = 0; i < n; i++)
+            node = node->next;
+        list_cut_position(&cut, head, node);
+        list_splice_tail(&cut, out);
+    } else {
+        mid_move(q, (q->size - n) / 2 - q->size / 2);
+        node = head->prev;
+        for (int i = 1; i < n; i++)
+            node = node->prev;
+        /* Set the kept part aside, hand over the rest, then restore */
+        list_cut_position(&cut, head, node->prev);
+        list_splice_tail_init(head, out);
+        list_splice(&cut, head);
+    }
+    q->size -= n;
+    return n;
+}
+
+static int remove_bulk(struct list_head *head,
+                       struct list_head *out,
+                       int n,
+                       bool at_head)
+{
+    if (head == NULL || list_empty(head) || n <= 0)
+        return 0;
+    if (!q_desc(head)->reversed)
+        return remove_links(head, out, n, at_head);
+
+    /* The nodes come off in link order; hand them over the other way round */
+    LIST_HEAD(tmp);
+    n = remove_links(head, &tmp, n, !at_head);
+    while (!list_empty(&tmp))
+        list_move_tail(tmp.prev, out);
+    return n;
+}
+
+int q_remove_head_bulk(struct list_head *head, struct list_head *out, int n)
+{
+    return remove_bulk(head, out, n, true);
+}
+
+int q_remove_tail_bulk(struct list_head *head, struct list_head *out, int n)
+{
+    return remove_bulk(head, out, n, false);
 }
 
 /*
@@ -134,8 +560,31 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
  */
 void q_release_element(element_t *e)
 {
-    free(e->value);
-    free(e);
+    if (!element_is_inline(e) && !element_is_mapped(e))
+        free(e->value);
+    element_free(e);
+}
+
+bool element_is_mapped(const element_t *e)
+{
+    const struct q_pool *pool = e->pool;
+    return pool && pool->map && e->value >= pool->map &&
+           e->value < pool->map + pool->map_len;
+}
+
+char *q_take_value(element_t *e, size_t *len)
+{
+    char *s = e->value;
+    if (element_is_inline(e) || element_is_mapped(e)) {
+        s = malloc(e->len + 1);
+        if (s == NULL)
+            return NULL;
+        memcpy(s, e->value, e->len + 1);
+    }
+    if (len)
+        *len = e->len;
+    element_free(e);
+    return s;
 }
 
 /*
@@ -144,28 +593,9 @@ void q_release_element(element_t *e)
  */
 int q_size(struct list_head *head)
 {
-    if (head == NULL || list_empty(head))
+    if (head == NULL)
         return 0;
-    int count = 0;
-    struct list_head *n;
-    list_for_each (n, head) {
-        count++;
-    }
-    return count;
-}
-
-struct list_head *q_get_mid(struct list_head *head)
-{
-    if (list_is_singular(head))
-        return head->next;
-    struct list_head *forward, *backward;
-    forward = head->next;
-    backward = head->prev;
-    while (forward != backward && forward->next != backward) {
-        forward = forward->next;
-        backward = backward->prev;
-    }
-    return forward;
+    return q_desc(head)->size;
 }
 
 /*
@@ -180,12 +610,56 @@ bool q_delete_mid(struct list_head *head)
 {
     if (head == NULL || list_empty(head))
         return false;
-    struct list_head *mid = q_get_mid(head);
+    queue_t *q = q_desc(head);
+    struct list_head *mid = q_get_mid(q);
+    if (!q->reversed && !(q->size & 1)) {
+        /* For even n, index (n - 1) / 2 is the node left of mid */
+        struct list_head *node = mid->prev;
+        list_del(node);
+        q->size--;
+        q_release_element(list_entry(node, element_t, list));
+        return true;
+    }
+    /*
+     * Otherwise mid itself goes, read from either end, and the new middle
+     * is on the left for even n
+     */
+    if (q->size == 1)
+        q->mid = NULL;
+    else
+        q->mid = (q->size & 1) ? mid->next : mid->prev;
     list_del(mid);
+    q->size--;
     q_release_element(list_entry(mid, element_t, list));
     return true;
 }
 
+/*
+ * Comparing elements.
+ *
+ * Keys settle most comparisons with one integer compare.  Equal keys mean
+ * equal strings unless both go on past eight bytes, and the rest is then
+ * compared with memcmp(), whose length is known from len, so the vector
+ * kernels of the C library apply instead of the byte loop of strcmp().
+ */
+static inline bool element_eq(const element_t *a, const element_t *b)
+{
+    return a->key == b->key && a->len == b->len &&
+           (a->len <= 8 || memcmp(a->value + 8, b->value + 8, a->len - 8) == 0);
+}
+
+/* Compare two elements, with the sign of strcmp() on their strings */
+static inline int element_cmp(const element_t *a, const element_t *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    if (a->len < 8 || b->len < 8)
+        return 0;
+    /* Take the terminator of the shorter string along */
+    size_t n = a->len < b->len ? a->len : b->len;
+    return memcmp(a->value + 8, b->value + 8, n - 8 + 1);
+}
+
 /*
  * Delete all nodes that have duplicate string,
  * leaving only distinct strings from the original list.
@@ -199,18 +673,139 @@ bool q_delete_dup(struct list_head *head)
 {
     if (head == NULL)
         return false;
+    queue_t *q = q_desc(head);
     element_t *e, *s;
     bool is_dup = false;
     list_for_each_entry_safe (e, s, head, list)
-        if (&s->list != head && strcmp(e->value, s->value) == 0) {
+        if (&s->list != head && element_eq(e, s)) {
             is_dup = true;
             list_del(&e->list);
             q_release_element(e);
+            q->size--;
         } else if (is_dup) {
             is_dup = false;
             list_del(&e->list);
             q_release_element(e);
+            q->size--;
+        }
+    q->mid = NULL;
+    return true;
+}
+
+/*
+ * 64-bit string hash in the style of wyhash: eight bytes are consumed at a
+ * time and folded in with a 64x64->128 bit multiply, whose halves are xored.
+ */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static uint64_t str_hash(const char *s, size_t len)
+{
+    const uint64_t p0 = 0xa0761d6478bd642full, p1 = 0xe7037ed1a0b428dbull,
+                   p2 = 0x8ebc6af09c88c6e3ull;
+    uint64_t h = p0 ^ len, w;
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8);
+        h = hash_mix(h ^ w, p1);
+    }
+    w = 0;
+    memcpy(&w, s, len);
+    return hash_mix(hash_mix(h ^ w, p2), p1 ^ p2);
+}
+
+/*
+ * Slot of the open addressing table used by q_delete_dup_unsorted.
+ * first is the earliest element seen with the value; the upper half of its
+ * hash is kept in tag so that most mismatches are settled without strcmp.
+ */
+struct dedup_slot {
+    element_t *first;
+    uint32_t tag;
+    uint32_t dup;
+};
+
+/*
+ * Quadratic fallback of q_delete_dup_unsorted for when the table cannot be
+ * allocated: every element is compared with the ones after it.
+ */
+static void dedup_scan(queue_t *q)
+{
+    struct list_head *node = q->head.next;
+    while (node != &q->head) {
+        element_t *first = list_entry(node, element_t, list);
+        bool dup = false;
+        struct list_head *cur, *next;
+        for (cur = node->next; cur != &q->head; cur = next) {
+            next = cur->next;
+            element_t *e = list_entry(cur, element_t, list);
+            if (!element_eq(first, e))
+                continue;
+            list_del(cur);
+            q_release_element(e);
+            q->size--;
+            dup = true;
+        }
+        node = node->next;
+        if (dup) {
+            list_del(&first->list);
+            q_release_element(first);
+            q->size--;
+        }
+    }
+}
+
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    if (head == NULL)
+        return false;
+    queue_t *q = q_desc(head);
+    if (q->size < 2)
+        return true;
+
+    /* Keep the load factor at or below one half */
+    size_t cap = 16;
+    while (cap < 2 * (size_t) q->size)
+        cap <<= 1;
+    struct dedup_slot *table = malloc(cap * sizeof(struct dedup_slot));
+    if (!table) {
+        dedup_scan(q);
+        q->mid = NULL;
+        return true;
+    }
+    memset(table, 0, cap * sizeof(struct dedup_slot));
+
+    /* Later copies go right away, the first one once it is known to repeat */
+    element_t *e, *s;
+    list_for_each_entry_safe (e, s, head, list) {
+        uint64_t h = str_hash(e->value, e->len);
+        uint32_t tag = h >> 32;
+        size_t i = h & (cap - 1);
+        for (; table[i].first; i = (i + 1) & (cap - 1)) {
+            if (table[i].tag == tag && element_eq(table[i].first, e))
+                break;
+        }
+        if (!table[i].first) {
+            table[i].first = e;
+            table[i].tag = tag;
+            continue;
+        }
+        table[i].dup = 1;
+        list_del(&e->list);
+        q_release_element(e);
+        q->size--;
+    }
+    for (size_t i = 0; i < cap; i++) {
+        if (table[i].dup) {
+            list_del(&table[i].first->list);
+            q_release_element(table[i].first);
+            q->size--;
         }
+    }
+    free(table);
+    q->mid = NULL;
     return true;
 }
 
@@ -219,6 +814,16 @@ bool q_delete_dup(struct list_head *head)
  */
 void q_swap(struct list_head *head)
 {
+    if (head == NULL)
+        return;
+    queue_t *q = q_desc(head);
+    /* Pairs only line up the same from both ends if n is even */
+    if (q->size & 1)
+        q_normalize(head);
+    /* The middle node trades places with its partner in the pair */
+    if (q->mid && q->size > 1)
+        q->mid = (q->size / 2) & 1 ? q->mid->prev : q->mid->next;
+
     struct list_head *node1, *node2;
     node1 = head->next;
     node2 = node1->next;
@@ -240,47 +845,1038 @@ void q_reverse(struct list_head *head)
 {
     if (head == NULL || list_empty(head))
         return;
-    struct list_head *n, *s;
-    list_for_each_safe (n, s, head) {
-        n->next = n->prev;
-        n->prev = s;
-    }
-    struct list_head *tmp;
-    tmp = head->next;
-    head->next = head->prev;
-    head->prev = tmp;
+    queue_t *q = q_desc(head);
+    q->reversed = !q->reversed;
 }
 
-void mergeTwoLists(struct list_head *L1, struct list_head *L2)
+/* Cut the first k nodes of head, which holds at least k, into group */
+static void cut_group(struct list_head *group, struct list_head *head, int k)
 {
-    struct list_head *node = L1->next;
-    element_t *E1, *E2;
-    while (!list_empty(L2) && node != L1) {
-        E1 = list_entry(node, element_t, list);
-        E2 = list_entry(L2->next, element_t, list);
-        if (strcmp(E1->value, E2->value) > 0) {
-            list_move_tail(&E2->list, &E1->list);
-        } else {
-            node = node->next;
-        }
-    }
-    list_splice_tail(L2, L1);
+    struct list_head *node = head;
+    while (k-- > 0)
+        node = node->next;
+    list_cut_position(group, head, node);
 }
 
-/*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
- */
-void q_sort(struct list_head *head)
+void q_reverseK(struct list_head *head, int k)
+{
+    if (head == NULL || k < 2 || q_desc(head)->size < k)
+        return;
+    queue_t *q = q_desc(head);
+    if (k == q->size) {
+        q_reverse(head);
+        return;
+    }
+
+    q_normalize(head);
+    LIST_HEAD(done);
+    for (int left = q->size; left >= k; left -= k) {
+        LIST_HEAD(group);
+        cut_group(&group, head, k);
+        reverse_links(&group);
+        list_splice_tail(&group, &done);
+    }
+    list_splice(&done, head);
+    q->mid = NULL;
+}
+
+void q_swapK(struct list_head *head, int k)
+{
+    if (head == NULL || k < 1 || q_desc(head)->size / 2 < k)
+        return;
+    queue_t *q = q_desc(head);
+    /* Pairs of groups only line up the same from both ends if they fill q */
+    if (q->size % (2 * k))
+        q_normalize(head);
+
+    LIST_HEAD(done);
+    for (int left = q->size; left / 2 >= k; left -= 2 * k) {
+        LIST_HEAD(first);
+        LIST_HEAD(second);
+        cut_group(&first, head, k);
+        cut_group(&second, head, k);
+        list_splice_tail(&second, &done);
+        list_splice_tail(&first, &done);
+    }
+    list_splice(&done, head);
+    q->mid = NULL;
+}
+
+/* Maximum number of pending runs; enough for 2^64 nodes, see merge_runs() */
+#define MAX_PENDING 64
+
+static inline int node_cmp(const struct list_head *a, const struct list_head *b)
+{
+    return element_cmp(list_entry(a, element_t, list),
+                       list_entry(b, element_t, list));
+}
+
+/*
+ * Merge two NULL-terminated chains linked through ->next only.
+ * Ties are taken from @a first, which keeps the sort stable.
+ */
+static struct list_head *merge_chains(struct list_head *a, struct list_head *b)
+{
+    struct list_head *head = NULL, **tail = &head;
+    for (;;) {
+        if (node_cmp(a, b) <= 0) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+        }
+    }
+    return head;
+}
+
+/*
+ * Detach the natural run starting at *list and advance *list past it.
+ * A non-decreasing run is taken as is; a strictly decreasing run is
+ * reversed in place, so that equal elements keep their relative order.
+ */
+static struct list_head *take_run(struct list_head **list, size_t *len)
+{
+    struct list_head *run = *list, *node = run->next;
+    size_t n = 1;
+
+    if (node && node_cmp(run, node) > 0) {
+        run->next = NULL;
+        do {
+            struct list_head *next = node->next;
+            node->next = run;
+            run = node;
+            node = next;
+            n++;
+        } while (node && node_cmp(run, node) > 0);
+    } else {
+        struct list_head *last = run;
+        while (node && node_cmp(last, node) <= 0) {
+            last = node;
+            node = node->next;
+            n++;
+        }
+        last->next = NULL;
+    }
+
+    *list = node;
+    *len = n;
+    return run;
+}
+
+/*
+ * Merge the pending runs on top of the stack as long as the older run is
+ * not more than twice as long as the younger one.  This keeps the lengths
+ * in the stack decreasing geometrically, so the depth never exceeds
+ * log2(n) + 1 and every merge combines runs of comparable size.
+ */
+static void merge_runs(struct list_head **runs, size_t *lens, int *depth)
+{
+    int d = *depth;
+    while (d > 1 && lens[d - 2] <= 2 * lens[d - 1]) {
+        runs[d - 2] = merge_chains(runs[d - 2], runs[d - 1]);
+        lens[d - 2] += lens[d - 1];
+        d--;
+    }
+    *depth = d;
+}
+
+/* Sort a NULL-terminated chain with the natural merge sort of q_sort */
+static struct list_head *sort_chain(struct list_head *list)
+{
+    struct list_head *runs[MAX_PENDING];
+    size_t lens[MAX_PENDING];
+    int depth = 0;
+
+    while (list) {
+        runs[depth] = take_run(&list, &lens[depth]);
+        depth++;
+        merge_runs(runs, lens, &depth);
+    }
+    while (depth > 1) {
+        runs[depth - 2] = merge_chains(runs[depth - 2], runs[depth - 1]);
+        depth--;
+    }
+    return runs[0];
+}
+
+/* Turn the queue's nodes into a NULL-terminated chain linked through next */
+static struct list_head *unlink_chain(struct list_head *head)
+{
+    head->prev->next = NULL;
+    return head->next;
+}
+
+/*
+ * Link a sorted chain back into head: restore the prev links, make the list
+ * circular again and pick up the middle node on the way.
+ */
+static void relink_chain(struct list_head *head, struct list_head *first)
+{
+    queue_t *q = q_desc(head);
+    struct list_head *prev = head, *node = first;
+    int idx = 0;
+    head->next = node;
+    for (; node; prev = node, node = node->next) {
+        node->prev = prev;
+        if (idx++ == q->size / 2)
+            q->mid = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ *
+ * This is a bottom-up natural merge sort in the spirit of list_sort() from
+ * the Linux kernel: the list is treated as a singly-linked chain, input runs
+ * are detected on the fly and kept on a small fixed stack, and the prev
+ * pointers are only rebuilt once at the end.  Already sorted or reversed
+ * input is handled in a single pass.
+ */
+void q_sort(struct list_head *head)
 {
     if (head == NULL || list_empty(head) || list_is_singular(head))
         return;
+    /* Equal elements keep their order, so a pending reversal must be applied */
+    q_normalize(head);
+    relink_chain(head, sort_chain(unlink_chain(head)));
+}
 
-    LIST_HEAD(tmp);
-    list_cut_position(&tmp, head, q_get_mid(head));
-    q_sort(head);
-    q_sort(&tmp);
-    mergeTwoLists(head, &tmp);
+/* Buckets smaller than this are finished with merge sort */
+#define RADIX_CUTOFF 32
+
+/* Levels of bucket recursion before the rest is left to merge sort */
+#define RADIX_MAX_LEVEL 32
+
+static inline unsigned char node_byte(const struct list_head *node,
+                                      size_t depth)
+{
+    return list_entry(node, element_t, list)->value[depth];
+}
+
+/*
+ * Sort a chain of n nodes whose strings agree on their first depth bytes.
+ * Nodes are distributed by their byte at depth, keeping input order within
+ * a bucket, and the resulting buckets are sorted recursively and joined, so
+ * the sort is stable.  Strings that end at depth are all equal and need no
+ * further work.  As long as every node lands in the same bucket, the next
+ * byte is tried in the same frame, so a long common prefix does not nest.
+ * Return the head of the sorted chain and store its last node in *tailp.
+ */
+static struct list_head *radix_chain(struct list_head *list,
+                                     size_t n,
+                                     size_t depth,
+                                     int level,
+                                     struct list_head **tailp)
+{
+    if (n < RADIX_CUTOFF || level >= RADIX_MAX_LEVEL) {
+        struct list_head *sorted = sort_chain(list), *tail = sorted;
+        while (tail->next)
+            tail = tail->next;
+        *tailp = tail;
+        return sorted;
+    }
+
+    struct list_head *heads[256], *tails[256];
+    size_t cnt[256];
+    int c;
+    for (;;) {
+        memset(cnt, 0, sizeof(cnt));
+        for (struct list_head *node = list, *next; node; node = next) {
+            next = node->next;
+            c = node_byte(node, depth);
+            if (cnt[c]++)
+                tails[c]->next = node;
+            else
+                heads[c] = node;
+            tails[c] = node;
+        }
+        c = node_byte(list, depth);
+        if (cnt[c] != n || c == 0)
+            break;
+        /* All nodes share this byte as well; look at the next one */
+        tails[c]->next = NULL;
+        depth++;
+    }
+
+    struct list_head *first = NULL, **link = &first, *last = NULL;
+    for (c = 0; c < 256; c++) {
+        if (!cnt[c])
+            continue;
+        tails[c]->next = NULL;
+        if (c == 0 || cnt[c] == 1) {
+            *link = heads[c];
+            last = tails[c];
+        } else {
+            *link = radix_chain(heads[c], cnt[c], depth + 1, level + 1, &last);
+        }
+        link = &last->next;
+    }
+    *link = NULL;
+    *tailp = last;
+    return first;
+}
+
+/*
+ * Sort elements of queue in ascending order with an MSD radix sort.
+ * Other attribute is as same as q_sort.
+ */
+void q_sort_radix(struct list_head *head)
+{
+    if (head == NULL || list_empty(head) || list_is_singular(head))
+        return;
+    q_normalize(head);
+    struct list_head *tail;
+    relink_chain(head, radix_chain(unlink_chain(head), q_desc(head)->size, 0,
+                                   0, &tail));
+}
+
+/* Upper bound on the threads used by q_sort_parallel */
+#define SORT_MAX_THREADS 64
+
+/* Smallest share of the queue worth handing to a thread of its own */
+#define SORT_MIN_PER_THREAD 4096
+
+struct sort_task {
+    struct list_head part;
+    struct list_head *chain;
+    struct list_head *other;
+};
+
+static void *sort_part(void *arg)
+{
+    struct sort_task *t = arg;
+    t->chain = sort_chain(unlink_chain(&t->part));
+    return NULL;
+}
+
+static void *merge_pair(void *arg)
+{
+    struct sort_task *t = arg;
+    t->chain = merge_chains(t->chain, t->other);
+    return NULL;
+}
+
+/*
+ * Run fn on each of the n tasks, one thread per task with the calling thread
+ * taking the first one.  The threads run with all signals blocked, so that
+ * signal handlers, such as the ones installed by qtest, only ever run on the
+ * calling thread, and only once q_sort_parallel allows it.  Tasks whose
+ * thread cannot be created are run inline.
+ */
+static void run_tasks(void *(*fn)(void *), struct sort_task *tasks, int n)
+{
+    pthread_t tids[SORT_MAX_THREADS];
+    bool started[SORT_MAX_THREADS];
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 1; i < n; i++)
+        started[i] = pthread_create(&tids[i], NULL, fn, &tasks[i]) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    fn(&tasks[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            fn(&tasks[i]);
+    }
+}
+
+/*
+ * Sort elements of queue in ascending order using up to threads threads.
+ * Other attribute is as same as q_sort, and the result is identical to it.
+ *
+ * The queue is cut into one part per thread with list_cut_position(), the
+ * parts are merge sorted concurrently and then combined by a tree merge,
+ * which merges neighbouring chains pairwise and so halves the number of
+ * busy threads every round.  No queue memory is allocated.
+ */
+void q_sort_parallel(struct list_head *head, int threads)
+{
+    if (head == NULL || list_empty(head) || list_is_singular(head))
+        return;
+    q_normalize(head);
+
+    int size = q_desc(head)->size;
+    int nparts = threads;
+    if (nparts > SORT_MAX_THREADS)
+        nparts = SORT_MAX_THREADS;
+    if (nparts > size / SORT_MIN_PER_THREAD)
+        nparts = size / SORT_MIN_PER_THREAD;
+    if (nparts < 2) {
+        q_sort(head);
+        return;
+    }
+
+    /*
+     * The nodes belong to the workers until the queue is relinked, so a
+     * handler that jumps out of the sort, as the time limit of qtest does,
+     * must not run before that.  SIGALRM is held back meanwhile and, if it
+     * fired, delivered once the queue is whole again.
+     */
+    sigset_t held, old;
+    sigemptyset(&held);
+    sigaddset(&held, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &held, &old);
+
+    /* Parts hold size / nparts elements, the first ones one more if needed */
+    struct sort_task tasks[SORT_MAX_THREADS];
+    for (int i = 0; i < nparts; i++) {
+        INIT_LIST_HEAD(&tasks[i].part);
+        if (i == nparts - 1) {
+            list_splice_init(head, &tasks[i].part);
+            break;
+        }
+        struct list_head *node = head;
+        for (int n = size / nparts + (i < size % nparts); n > 0; n--)
+            node = node->next;
+        list_cut_position(&tasks[i].part, head, node);
+    }
+    run_tasks(sort_part, tasks, nparts);
+
+    /* Chains are kept in task order, and earlier ones win ties */
+    for (int n = nparts; n > 1; n = (n + 1) / 2) {
+        struct sort_task pairs[SORT_MAX_THREADS / 2];
+        int npairs = n / 2;
+        for (int i = 0; i < npairs; i++) {
+            pairs[i].chain = tasks[2 * i].chain;
+            pairs[i].other = tasks[2 * i + 1].chain;
+        }
+        run_tasks(merge_pair, pairs, npairs);
+        for (int i = 0; i < npairs; i++)
+            tasks[i].chain = pairs[i].chain;
+        if (n & 1)
+            tasks[npairs].chain = tasks[n - 1].chain;
+    }
+
+    relink_chain(head, tasks[0].chain);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Ways merged in one tournament; more queues are merged in several rounds */
+#define MERGE_MAX_WAYS 256
+
+/*
+ * Whether the head of way a comes before the head of way b.  Exhausted ways
+ * come last, and ties go to the earlier way, which keeps the merge stable.
+ */
+static inline bool way_wins(struct list_head **ways, int a, int b)
+{
+    if (!ways[b])
+        return true;
+    if (!ways[a])
+        return false;
+    int c = node_cmp(ways[a], ways[b]);
+    return c < 0 || (c == 0 && a < b);
+}
+
+/*
+ * Play the matches below node of the tree of losers over k ways, storing the
+ * loser of each match in its node, and return the winner.  Nodes 1 to k - 1
+ * are matches, node k + w is the leaf of way w and node i has children 2i
+ * and 2i + 1.
+ */
+static int play_matches(struct list_head **ways, int *tree, int k, int node)
+{
+    if (node >= k)
+        return node - k;
+    int a = play_matches(ways, tree, k, 2 * node);
+    int b = play_matches(ways, tree, k, 2 * node + 1);
+    if (way_wins(ways, a, b)) {
+        tree[node] = b;
+        return a;
+    }
+    tree[node] = a;
+    return b;
+}
+
+/*
+ * Merge k sorted NULL-terminated chains, 1 <= k <= MERGE_MAX_WAYS, into the
+ * empty list head, linking both ways as the nodes go.
+ * After taking the head of the winning way, only the matches on the path
+ * from its leaf to the root are replayed, against the losers stored there.
+ */
+static void merge_ways(struct list_head **ways, int k, struct list_head *head)
+{
+    int tree[MERGE_MAX_WAYS];
+    int w = play_matches(ways, tree, k, 1);
+    struct list_head *prev = head;
+
+    while (ways[w]) {
+        struct list_head *node = ways[w];
+        ways[w] = node->next;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+        for (int node = (k + w) / 2; node > 0; node /= 2) {
+            if (way_wins(ways, tree[node], w)) {
+                int t = tree[node];
+                tree[node] = w;
+                w = t;
+            }
+        }
+    }
+    prev->next = head;
+    head->prev = prev;
 }
 
+int q_merge(struct list_head *head)
+{
+    if (head == NULL)
+        return 0;
+
+    struct list_head *ways[MERGE_MAX_WAYS];
+    int k = 0, size = 0;
+    queue_context_t *ctx, *first = NULL;
+    list_for_each_entry (ctx, head, chain) {
+        if (ctx->q == NULL)
+            continue;
+        if (first == NULL)
+            first = ctx;
+        queue_t *q = q_desc(ctx->q);
+        ctx->size = 0;
+        /* Even an empty queue, as the first one receives the merged chain */
+        q_normalize(ctx->q);
+        if (list_empty(ctx->q))
+            continue;
+        size += q->size;
+        if (k == MERGE_MAX_WAYS) {
+            LIST_HEAD(merged);
+            merge_ways(ways, k, &merged);
+            ways[0] = unlink_chain(&merged);
+            k = 1;
+        }
+        ways[k++] = unlink_chain(ctx->q);
+        INIT_LIST_HEAD(ctx->q);
+        q->size = 0;
+        q->mid = NULL;
+    }
+    if (first == NULL || k == 0)
+        return 0;
+
+    merge_ways(ways, k, first->q);
+    q_desc(first->q)->size = size;
+    first->size = size;
+    return size;
+}
+
+/*
+ * External sort.
+ *
+ * Chunks of about run_bytes of elements are cut off the head of the queue,
+ * sorted, written to temporary files as runs of null-terminated strings and
+ * released.  What is left at the end stays in memory and is sorted there.
+ * The runs are then mapped back and merged under a tree of losers with the
+ * part in memory, whose nodes are relinked rather than copied.  All writes
+ * go through one buffer of anonymous memory, which the runs and the output
+ * share.  Once EXT_MAX_RUNS runs exist, they are merged into a single one.
+ */
+#define EXT_MAX_RUNS 64
+#define EXT_BUF_SIZE (1 << 20)
+
+struct ext_run {
+    FILE *file;
+    size_t bytes;
+};
+
+struct ext_sort {
+    struct ext_run runs[EXT_MAX_RUNS];
+    int nruns;
+    char *buf;
+    size_t used;
+};
+
+/* Way of the merge: a mapped run, or the sorted chain kept in memory */
+struct ext_way {
+    const char *cur; /* Current string, NULL once exhausted */
+    const char *base, *end;
+    struct list_head *node; /* Current node when reading from memory */
+};
+
+static bool write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+static bool ext_flush(struct ext_sort *x, int fd)
+{
+    bool ok = write_all(fd, x->buf, x->used);
+    x->used = 0;
+    return ok;
+}
+
+static bool ext_write(struct ext_sort *x, int fd, const char *p, size_t n)
+{
+    if (x->used + n > EXT_BUF_SIZE) {
+        if (!ext_flush(x, fd))
+            return false;
+        if (n > EXT_BUF_SIZE)
+            return write_all(fd, p, n);
+    }
+    memcpy(x->buf + x->used, p, n);
+    x->used += n;
+    return true;
+}
+
+/* Write the string s of length len followed by sep */
+static inline bool ext_put(struct ext_sort *x,
+                           int fd,
+                           const char *s,
+                           size_t len,
+                           char sep)
+{
+    return ext_write(x, fd, s, len) && ext_write(x, fd, &sep, 1);
+}
+
+static inline size_t element_bytes(const element_t *e)
+{
+    return sizeof(element_t) + (element_is_inline(e) ? 0 : e->len + 1);
+}
+
+static inline bool ext_way_wins(const struct ext_way *ways, int a, int b)
+{
+    if (!ways[b].cur)
+        return true;
+    if (!ways[a].cur)
+        return false;
+    int c = strcmp(ways[a].cur, ways[b].cur);
+    return c < 0 || (c == 0 && a < b);
+}
+
+/* Same as play_matches(), over the ways of an external merge */
+static int ext_play(const struct ext_way *ways, int *tree, int k, int node)
+{
+    if (node >= k)
+        return node - k;
+    int a = ext_play(ways, tree, k, 2 * node);
+    int b = ext_play(ways, tree, k, 2 * node + 1);
+    if (ext_way_wins(ways, a, b)) {
+        tree[node] = b;
+        return a;
+    }
+    tree[node] = a;
+    return b;
+}
+
+static void ext_advance(struct ext_way *w)
+{
+    if (w->node) {
+        w->node = w->node->next;
+        w->cur = w->node ? list_entry(w->node, element_t, list)->value : NULL;
+    } else {
+        w->cur += strlen(w->cur) + 1;
+        if (w->cur == w->end)
+            w->cur = NULL;
+    }
+}
+
+/*
+ * Merge the runs and the sorted chain mem, which may be NULL, into head
+ * if out is negative, or else write them to out, each string followed by
+ * sep.  The runs are left as they are.  Should this fail, the nodes of mem
+ * that were not merged yet are appended to head, if there is one.
+ */
+static bool ext_merge(struct ext_sort *x,
+                      struct list_head *mem,
+                      struct list_head *head,
+                      int out,
+                      char sep)
+{
+    struct ext_way ways[EXT_MAX_RUNS + 1];
+    int tree[EXT_MAX_RUNS + 1];
+    int k = 0;
+    bool ok = true;
+
+    for (int i = 0; i < x->nruns; i++) {
+        size_t bytes = x->runs[i].bytes;
+        char *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE,
+                         fileno(x->runs[i].file), 0);
+        if (map == MAP_FAILED) {
+            ok = false;
+            break;
+        }
+        madvise(map, bytes, MADV_SEQUENTIAL);
+        ways[k].cur = ways[k].base = map;
+        ways[k].end = map + bytes;
+        ways[k].node = NULL;
+        k++;
+    }
+    int nmaps = k;
+    if (ok && mem) {
+        ways[k].cur = list_entry(mem, element_t, list)->value;
+        ways[k].base = ways[k].end = NULL;
+        ways[k].node = mem;
+        k++;
+        mem = NULL;
+    }
+
+    queue_t *q = head ? q_desc(head) : NULL;
+    int w = ok && k > 0 ? ext_play(ways, tree, k, 1) : 0;
+    while (ok && k > 0 && ways[w].cur) {
+        struct list_head *node = ways[w].node;
+        const char *s = ways[w].cur;
+        if (out >= 0) {
+            size_t len = node ? list_entry(node, element_t, list)->len
+                              : strlen(s);
+            ok = ext_put(x, out, s, len, sep);
+            if (!ok)
+                break;
+            ext_advance(&ways[w]);
+            if (node)
+                q_release_element(list_entry(node, element_t, list));
+        } else {
+            if (!node) {
+                element_t *e = element_new(q, s);
+                if (e == NULL) {
+                    ok = false;
+                    break;
+                }
+                node = &e->list;
+            }
+            ext_advance(&ways[w]);
+            list_add_tail(node, head);
+            q->size++;
+        }
+        for (int i = (k + w) / 2; i > 0; i /= 2) {
+            if (ext_way_wins(ways, tree[i], w)) {
+                int t = tree[i];
+                tree[i] = w;
+                w = t;
+            }
+        }
+    }
+    if (ok && out >= 0)
+        ok = ext_flush(x, out);
+
+    if (k > nmaps)
+        mem = ways[nmaps].node;
+    for (; head && mem; q->size++) {
+        struct list_head *next = mem->next;
+        list_add_tail(mem, head);
+        mem = next;
+    }
+    for (int i = 0; i < nmaps; i++)
+        munmap((void *) ways[i].base, ways[i].end - ways[i].base);
+    return ok;
+}
+
+static void ext_close_runs(struct ext_sort *x)
+{
+    for (int i = 0; i < x->nruns; i++)
+        fclose(x->runs[i].file);
+    x->nruns = 0;
+}
+
+/* Merge all runs into a single one; on failure they are left as they are */
+static bool ext_cascade(struct ext_sort *x)
+{
+    FILE *f = tmpfile();
+    if (f == NULL)
+        return false;
+    size_t bytes = 0;
+    for (int i = 0; i < x->nruns; i++)
+        bytes += x->runs[i].bytes;
+    if (!ext_merge(x, NULL, NULL, fileno(f), '\0')) {
+        x->used = 0;
+        fclose(f);
+        return false;
+    }
+    ext_close_runs(x);
+    x->runs[0].file = f;
+    x->runs[0].bytes = bytes;
+    x->nruns = 1;
+    return true;
+}
+
+/* Write the sorted chain to a new run and release its elements */
+static bool ext_spill(struct ext_sort *x, struct list_head *chain)
+{
+    if (x->nruns == EXT_MAX_RUNS && !ext_cascade(x))
+        return false;
+    FILE *f = tmpfile();
+    if (f == NULL)
+        return false;
+    int fd = fileno(f);
+    size_t bytes = 0;
+    struct list_head *node;
+    for (node = chain; node; node = node->next) {
+        element_t *e = list_entry(node, element_t, list);
+        if (!ext_put(x, fd, e->value, e->len, '\0'))
+            break;
+        bytes += e->len + 1;
+    }
+    if (node || !ext_flush(x, fd)) {
+        x->used = 0;
+        fclose(f);
+        return false;
+    }
+    while (chain) {
+        element_t *e = list_entry(chain, element_t, list);
+        chain = chain->next;
+        q_release_element(e);
+    }
+    x->runs[x->nruns].file = f;
+    x->runs[x->nruns].bytes = bytes;
+    x->nruns++;
+    return true;
+}
+
+bool q_sort_external(struct list_head *head, size_t run_bytes, int out)
+{
+    if (head == NULL)
+        return false;
+    queue_t *q = q_desc(head);
+    /* A pending reversal is applied first, so that ties keep their order */
+    q_normalize(head);
+    if (out < 0 && run_bytes == 0) {
+        q_sort(head);
+        return true;
+    }
+
+    struct ext_sort x = {.nruns = 0, .used = 0};
+    x.buf = mmap(NULL, EXT_BUF_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (x.buf == MAP_FAILED)
+        return false;
+
+    /* Spill as long as more than run_bytes remain; stop if a spill fails */
+    while (run_bytes > 0) {
+        size_t bytes = 0;
+        int n = 0;
+        struct list_head *node = head->next;
+        for (; node != head && bytes < run_bytes; node = node->next, n++)
+            bytes += element_bytes(list_entry(node, element_t, list));
+        if (node == head)
+            break;
+        LIST_HEAD(chunk);
+        list_cut_position(&chunk, head, node->prev);
+        struct list_head *sorted = sort_chain(unlink_chain(&chunk));
+        if (!ext_spill(&x, sorted)) {
+            /* Keep the chunk, sorted, at the front of the queue */
+            INIT_LIST_HEAD(&chunk);
+            for (node = sorted; node;) {
+                struct list_head *next = node->next;
+                list_add_tail(node, &chunk);
+                node = next;
+            }
+            list_splice(&chunk, head);
+            break;
+        }
+        q->size -= n;
+    }
+
+    bool ok;
+    if (x.nruns == 0 && out < 0) {
+        q_sort(head);
+        ok = true;
+    } else {
+        struct list_head *mem = list_empty(head) ? NULL : unlink_chain(head);
+        if (mem)
+            mem = sort_chain(mem);
+        INIT_LIST_HEAD(head);
+        q->size = 0;
+        q->mid = NULL;
+        ok = ext_merge(&x, mem, head, out, '\n');
+    }
+    ext_close_runs(&x);
+    munmap(x.buf, EXT_BUF_SIZE);
+    return ok;
+}
+
+/*
+ * Snapshots.
+ *
+ * A snapshot holds a header, a table of count offsets and a blob of count
+ * records, all in native byte order.  Each offset is that of a record from
+ * the start of the blob, and each record is a 32-bit length followed by the
+ * string and its null byte.  q_load() maps the file and points the values
+ * of the elements right at their strings, so nothing is copied; the
+ * mapping belongs to a pool of its own which carries the elements and goes
+ * away with the last of them.
+ */
+#define SNAP_MAGIC "lab0-q1"
+
+struct snap_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t blob_bytes;
+};
+
+/* Node after node, reading the queue from its logical head to its tail */
+static inline struct list_head *snap_step(const queue_t *q,
+                                          const struct list_head *node)
+{
+    return q->reversed ? node->prev : node->next;
+}
+
+bool q_save(struct list_head *head, const char *path)
+{
+    if (head == NULL)
+        return false;
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
+
+    queue_t *q = q_desc(head);
+    struct snap_header h = {.magic = SNAP_MAGIC, .count = q->size};
+    struct list_head *node;
+    element_t *e;
+
+    for (node = snap_step(q, head); node != head; node = snap_step(q, node)) {
+        e = list_entry(node, element_t, list);
+        h.blob_bytes += sizeof(uint32_t) + e->len + 1;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t off = 0;
+    for (node = snap_step(q, head); ok && node != head;
+         node = snap_step(q, node)) {
+        e = list_entry(node, element_t, list);
+        ok = fwrite(&off, sizeof(off), 1, f) == 1;
+        off += sizeof(uint32_t) + e->len + 1;
+    }
+    for (node = snap_step(q, head); ok && node != head;
+         node = snap_step(q, node)) {
+        e = list_entry(node, element_t, list);
+        uint32_t len = e->len;
+        ok = fwrite(&len, sizeof(len), 1, f) == 1 &&
+             fwrite(e->value, e->len + 1, 1, f) == 1;
+    }
+
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        remove(path);
+    return ok;
+}
+
+/* Check that the mapped file is a snapshot whose records all fit */
+static bool snap_valid(const char *map, size_t bytes)
+{
+    struct snap_header h;
+    if (bytes < sizeof(h))
+        return false;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) ||
+        h.count > (bytes - sizeof(h)) / sizeof(uint64_t) ||
+        h.blob_bytes != bytes - sizeof(h) - h.count * sizeof(uint64_t))
+        return false;
+
+    const char *table = map + sizeof(h);
+    const char *blob = table + h.count * sizeof(uint64_t);
+    for (uint64_t i = 0; i < h.count; i++) {
+        uint64_t off;
+        uint32_t len;
+        memcpy(&off, table + i * sizeof(off), sizeof(off));
+        if (off > h.blob_bytes || h.blob_bytes - off <= sizeof(len))
+            return false;
+        memcpy(&len, blob + off, sizeof(len));
+        if (len >= h.blob_bytes - off - sizeof(len) ||
+            blob[off + sizeof(len) + len] != '\0')
+            return false;
+    }
+    return true;
+}
+
+bool q_load(struct list_head *head, const char *path)
+{
+    if (head == NULL)
+        return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    size_t bytes = st.st_size;
+
+    queue_t *q = q_desc(head);
+    struct snap_header h;
+    memcpy(&h, map, bytes < sizeof(h) ? bytes : sizeof(h));
+    if (!snap_valid(map, bytes) || h.count > (uint64_t) (INT_MAX - q->size)) {
+        munmap(map, bytes);
+        return false;
+    }
+    if (h.count == 0) {
+        munmap(map, bytes);
+        return true;
+    }
+
+    struct q_pool *pool = malloc(sizeof(struct q_pool));
+    struct pool_chunk *c =
+        malloc(sizeof(struct pool_chunk) + h.count * sizeof(element_t));
+    if (pool == NULL || c == NULL) {
+        free(pool);
+        free(c);
+        munmap(map, bytes);
+        return false;
+    }
+    /* No queue owns the pool, so it is an orphan from the start */
+    c->next = NULL;
+    c->nslots = h.count;
+    pool->chunks = c;
+    pool->used = h.count;
+    pool->free_list = NULL;
+    pool->live = h.count;
+    pool->orphan = true;
+    pool->map = map;
+    pool->map_len = bytes;
+
+    const char *table = map + sizeof(h);
+    char *blob = map + sizeof(h) + h.count * sizeof(uint64_t);
+    LIST_HEAD(loaded);
+    for (uint64_t i = 0; i < h.count; i++) {
+        element_t *e = &c->slots[i];
+        uint64_t off;
+        uint32_t len;
+        memcpy(&off, table + i * sizeof(off), sizeof(off));
+        memcpy(&len, blob + off, sizeof(len));
+        e->value = blob + off + sizeof(len);
+        e->len = len;
+        e->key = str_key(e->value, len);
+        e->pool = pool;
+        /* Build the chain so that it reads in order from the logical tail */
+        if (q->reversed)
+            list_add(&e->list, &loaded);
+        else
+            list_add_tail(&e->list, &loaded);
+    }
+    if (q->reversed)
+        list_splice(&loaded, head);
+    else
+        list_splice_tail(&loaded, head);
+    q->size += h.count;
+    q->mid = NULL;
+    return true;
+}
@@ -10,25 +10,101 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "list.h"
 
+struct q_pool;
+
+/* Strings shorter than this are stored inside their element */
+#define ELEMENT_INLINE_LEN 16
+
 /* Linked list element */
 typedef struct {
     /* Pointer to array holding string.
-     * This array needs to be explicitly allocated and freed
+     * This is either inline_value, a separately allocated copy for
+     * strings that do not fit, or the string in a snapshot mapped by
+     * q_load(), so it can always be read as is.
      */
     char *value;
+    /* Length of value, not counting the terminating null byte */
+    size_t len;
+    /* First eight bytes of value, zero-padded and read big-endian, so that
+     * comparing keys as integers orders them like strcmp()
+     */
+    uint64_t key;
     struct list_head list;
+    /* Pool the element was carved from, or NULL if it came from malloc */
+    struct q_pool *pool;
+    char inline_value[ELEMENT_INLINE_LEN];
 } element_t;
 
+/* Whether the string of e lives inside the element itself */
+static inline bool element_is_inline(const element_t *e)
+{
+    return e->value == e->inline_value;
+}
+
+/* Whether the string of e points into a snapshot mapped by q_load() */
+bool element_is_mapped(const element_t *e);
+
+/*
+ * Queue descriptor.
+ * Functions below take and return the embedded list head, so it must stay in
+ * first position; use q_desc() to get from the head back to the descriptor.
+ * Only heads obtained from q_new() may be passed to the q_* functions.
+ */
+typedef struct {
+    struct list_head head;
+    /* Number of elements in queue */
+    int size;
+    /* Node at index size / 2, or NULL if it has to be recomputed */
+    struct list_head *mid;
+    /* Element pool used for insertions, or NULL */
+    struct q_pool *pool;
+    /* Elements run from head->prev to head->next, see q_normalize() */
+    bool reversed;
+} queue_t;
+
+static inline queue_t *q_desc(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/*
+ * Link of a chain of queues, such as the one passed to q_merge().
+ * The chain itself is a plain list head; the contexts are linked through
+ * chain.
+ */
+typedef struct {
+    /* Queue obtained from q_new(), or NULL */
+    struct list_head *q;
+    struct list_head chain;
+    /* Number of elements in q */
+    int size;
+    /* Identifier assigned by the owner of the chain */
+    int id;
+} queue_context_t;
+
 /* Operations on queue */
 
 /*
  * Create empty queue.
+ * The returned list head is embedded in a queue_t, which caches the number
+ * of elements and the middle node.
  * Return NULL if could not allocate space.
  */
 struct list_head *q_new();
 
+/*
+ * Create empty queue whose elements are carved from a private pool.
+ * The pool grows in large chunks and recycles released elements, so most
+ * insertions and releases of short strings do not call malloc or free.
+ * Elements removed from the queue stay valid after q_free() and the pool
+ * is returned to the system with the last of them.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_pool();
+
 /*
  * Free ALL storage used by queue.
  * No effect if q is NULL
@@ -53,6 +129,37 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/*
+ * Callback supplying strings for bulk insertion.
+ * Return the string for the i-th new element; it is copied before the
+ * callback is invoked again, so the same buffer may be reused.
+ */
+typedef char *(*q_gen_t)(void *arg, int i);
+
+/*
+ * Attempt to insert n elements at head of queue, holding the strings
+ * sv[0] .. sv[n - 1].  The result is the same as calling q_insert_head()
+ * for each of them in turn, but the new elements are linked into a chain
+ * first and spliced onto the queue at once.
+ * Stop at the first element that could not be allocated; the ones built
+ * before it are still inserted.
+ * Return the number of elements inserted, 0 if q is NULL.
+ */
+int q_insert_head_bulk(struct list_head *head, char **sv, int n);
+
+/*
+ * Attempt to insert n elements at tail of queue.
+ * Other attribute is as same as q_insert_head_bulk.
+ */
+int q_insert_tail_bulk(struct list_head *head, char **sv, int n);
+
+/*
+ * Like q_insert_head_bulk and q_insert_tail_bulk, but the i-th string is
+ * obtained by calling gen(arg, i).
+ */
+int q_insert_head_gen(struct list_head *head, q_gen_t gen, void *arg, int n);
+int q_insert_tail_gen(struct list_head *head, q_gen_t gen, void *arg, int n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
@@ -63,6 +170,8 @@ bool q_insert_tail(struct list_head *head, char *s);
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
  * The only thing "remove" need to do is unlink it.
+ * With sp NULL nothing is copied at all: the caller reads value and len of
+ * the element, or takes the string over with q_take_value().
  *
  * REF:
  * https://english.stackexchange.com/questions/52508/difference-between-delete-and-remove
@@ -75,17 +184,60 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove up to n elements from head of queue.
+ * The elements are moved, in queue order, to the tail of the list out,
+ * which may be any list head, e.g. one declared with LIST_HEAD.
+ * Like q_remove_head, nothing is freed; release each element when done.
+ * Return the number of elements moved, 0 if q is NULL or empty.
+ */
+int q_remove_head_bulk(struct list_head *head, struct list_head *out, int n);
+
+/*
+ * Attempt to remove up to n elements from tail of queue.
+ * Other attribute is as same as q_remove_head_bulk.
+ */
+int q_remove_tail_bulk(struct list_head *head, struct list_head *out, int n);
+
 /*
  * Attempt to release element.
  */
 void q_release_element(element_t *e);
 
+/*
+ * Release a removed element but hand its string over to the caller, who
+ * frees it with free().  A string kept outside the element is passed on as
+ * is; one stored inside it or in a mapped snapshot is first copied to a
+ * buffer of its own.
+ * If len is non-NULL, the length of the string is stored in *len.
+ * Return NULL if that buffer could not be allocated, in which case the
+ * element is left untouched.
+ */
+char *q_take_value(element_t *e, size_t *len);
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
+ * The count is cached in the queue descriptor, so this takes O(1).
  */
 int q_size(struct list_head *head);
 
+/*
+ * Tell the queue that its nodes were rearranged outside of the q_* functions,
+ * e.g. with list_move(), so that cached positions get recomputed.
+ * The set of nodes must not change.  No effect if q is NULL.
+ */
+void q_reordered(struct list_head *head);
+
+/*
+ * Make the links run from the first element to the last again.
+ * q_reverse() only flips a direction flag, which the q_* functions honor, so
+ * code that walks the list itself, e.g. with list_for_each(), must call this
+ * first.  It takes O(n) after a reversal and O(1) otherwise.
+ * No effect if q is NULL.
+ */
+void q_normalize(struct list_head *head);
+
 /*
  * Delete the middle node in list.
  * The middle node of a linked list of size n is the
@@ -93,6 +245,7 @@ int q_size(struct list_head *head);
  * If there're six element, the third member should be return.
  * Return true if successful.
  * Return false if list is NULL or empty.
+ * The middle node is tracked across updates, so this is O(1) amortized.
  *
  * Ref: https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
  */
@@ -108,6 +261,16 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/*
+ * Delete all nodes that have duplicate string, like q_delete_dup, without
+ * requiring the list to be sorted.  Distinct strings keep their relative
+ * order.  Duplicates are found in a single pass with a hash table, or by
+ * comparing every pair of elements if the table could not be allocated.
+ * Return true if successful.
+ * Return false if list is NULL.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /*
  * Attempt to swap every two adjacent nodes.
  *
@@ -121,9 +284,29 @@ void q_swap(struct list_head *head);
  * This function should not allocate or free any list elements
  * (e.g., by calling q_insert_head, q_insert_tail, or q_remove_head).
  * It should rearrange the existing ones.
+ * The reversal is lazy and takes O(1): the links are only rewritten once
+ * another operation needs them in order, or by q_normalize().
  */
 void q_reverse(struct list_head *head);
 
+/*
+ * Reverse the nodes of the list k at a time; the nodes left over at the
+ * tail, fewer than k, keep their order.  No effect if q is NULL or k < 2.
+ * Each group is cut from the queue with list_cut_position(), reversed in
+ * place and spliced onto the result, so no node is moved on its own.
+ *
+ * Ref: https://leetcode.com/problems/reverse-nodes-in-k-group/
+ */
+void q_reverseK(struct list_head *head, int k);
+
+/*
+ * Swap every two adjacent groups of k nodes, so that q_swapK(head, 1) is
+ * q_swap(head).  The nodes left over at the tail, fewer than 2k, keep their
+ * place.  Groups are cut out and spliced back in the other order, which only
+ * rewrites the links at their boundaries.  No effect if q is NULL or k < 1.
+ */
+void q_swapK(struct list_head *head, int k);
+
 /*
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
@@ -131,4 +314,73 @@ void q_reverse(struct list_head *head);
  */
 void q_sort(struct list_head *head);
 
+/*
+ * Sort elements of queue in ascending order, like q_sort, with a stable
+ * most-significant-digit radix sort.  Elements are bucketed on successive
+ * characters and small buckets are finished with merge sort, which avoids
+ * most string comparisons on large queues of short strings.
+ */
+void q_sort_radix(struct list_head *head);
+
+/*
+ * Sort elements of queue in ascending order, like q_sort, on up to threads
+ * threads.  The queue is split into one part per thread, the parts are
+ * sorted concurrently and then merged.  Small queues, or a thread count
+ * below 2, are sorted on the calling thread.  SIGALRM is held back on the
+ * calling thread while the threads run, so a time limit fires only once
+ * the queue is linked together again.
+ */
+void q_sort_parallel(struct list_head *head, int threads);
+
+/*
+ * Merge all the queues of a chain of queue_context_t into the first one that
+ * is not NULL, leaving the others empty, and update their size fields.
+ * Every queue must be sorted in ascending order, and so is the result; equal
+ * elements keep the order of their queues in the chain.
+ * The nodes are spliced together under a tree of losers over the heads of
+ * the queues, which takes O(log k) comparisons per element for k queues, and
+ * nothing is allocated.
+ * Return the number of elements in the merged queue, 0 if head is NULL or
+ * holds no queue.
+ *
+ * Ref: https://leetcode.com/problems/merge-k-sorted-lists/
+ */
+int q_merge(struct list_head *head);
+
+/*
+ * Sort elements of queue in ascending order, like q_sort, keeping no more
+ * than about run_bytes of elements in memory; 0 means no limit.  Past that,
+ * sorted runs are written to temporary files and their elements freed, and
+ * the runs are merged back at the end.
+ * If out is negative, the result is linked back into the queue, which takes
+ * as much memory as the queue did.  Otherwise, the sorted strings are written
+ * to the file descriptor out, one per line, and every element is freed as
+ * it goes, leaving the queue empty.
+ * Return false if head is NULL, or if the runs could not be read back or out
+ * could not be written.  The queue then keeps the elements that were still
+ * in memory, while strings of the runs not merged yet are lost.  A run that
+ * cannot be written is not an error; its elements just stay in memory.
+ */
+bool q_sort_external(struct list_head *head, size_t run_bytes, int out);
+
+/*
+ * Write the strings of queue, from head to tail, to a snapshot file at path,
+ * replacing any file there.  The format is described in queue.c.
+ * Return false if head is NULL or the file could not be written, in which
+ * case it is removed.
+ */
+bool q_save(struct list_head *head, const char *path);
+
+/*
+ * Append the strings of the snapshot at path to the tail of queue.
+ * The file is mapped and the new elements point right into it, so loading
+ * takes a single pass over the records and copies no string.  The mapping
+ * is private and is released with the last of these elements; the file
+ * must not be truncated meanwhile.
+ * Return false if head is NULL, the file could not be mapped, is not a
+ * valid snapshot or holds too many strings, or if space could not be
+ * allocated.  The queue is then left as it was.
+ */
+bool q_load(struct list_head *head, const char *path);
+
 #endif /* LAB0_QUEUE_H */
@@ -1,7 +1,9 @@
 #include "random.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 /* shameless stolen from ebacs */
@@ -37,3 +39,71 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+static uint64_t prng_state[4];
+static bool prng_seeded = false;
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Expand the seed with splitmix64, which never yields an all-zero state */
+void prng_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        prng_state[i] = z ^ (z >> 31);
+    }
+    prng_seeded = true;
+}
+
+uint64_t prng_next(void)
+{
+    if (!prng_seeded) {
+        uint64_t seed;
+        randombytes((uint8_t *) &seed, sizeof(seed));
+        prng_seed(seed);
+    }
+
+    uint64_t *s = prng_state;
+    uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/*
+ * Lemire's multiply-and-shift reduction, rejecting the few products that
+ * would make the low results more likely than the others.
+ */
+uint32_t prng_below(uint32_t bound)
+{
+    uint64_t m = (prng_next() >> 32) * bound;
+    if ((uint32_t) m < bound) {
+        uint32_t threshold = -bound % bound;
+        while ((uint32_t) m < threshold)
+            m = (prng_next() >> 32) * bound;
+    }
+    return m >> 32;
+}
+
+void prng_fill(uint8_t *x, size_t xlen)
+{
+    for (; xlen >= sizeof(uint64_t); xlen -= sizeof(uint64_t)) {
+        uint64_t r = prng_next();
+        memcpy(x, &r, sizeof(r));
+        x += sizeof(r);
+    }
+    if (xlen) {
+        uint64_t r = prng_next();
+        memcpy(x, &r, xlen);
+    }
+}
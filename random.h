@@ -13,4 +13,18 @@ static inline uint8_t randombit(void)
     return ret & 1;
 }
 
+/*
+ * xoshiro256++ generator, much cheaper than randombytes() and reproducible
+ * once seeded.  Without a call to prng_seed(), it seeds itself from
+ * randombytes() on first use.
+ */
+void prng_seed(uint64_t seed);
+uint64_t prng_next(void);
+
+/* Uniform random integer in [0, bound), bound > 0 */
+uint32_t prng_below(uint32_t bound);
+
+/* Fill x with xlen random bytes, eight per step of the generator */
+void prng_fill(uint8_t *x, size_t xlen);
+
 #endif
@@ -39,6 +39,11 @@ static void default_fatal_fun()
 /* Optional function to call when fatal error encountered */
 static void (*fatal_fun)() = default_fatal_fun;
 
+void set_report_file(FILE *file)
+{
+    init_files(file ? file : stdout, file ? file : stdout);
+}
+
 void set_verblevel(int level)
 {
     verblevel = level;
@@ -274,6 +279,12 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+void mem_usage(size_t *currentp, size_t *peakp)
+{
+    *currentp = current_bytes;
+    *peakp = peak_bytes;
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
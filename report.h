@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 /* Default reporting level.  Must recompile when change */
 #ifndef RPT
@@ -19,6 +20,9 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL } message_t;
 
 bool set_logfile(char *file_name);
 
+/* Send what report and report_event print to file; NULL means stdout */
+void set_report_file(FILE *file);
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -49,6 +53,9 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Current and peak bytes held through the functions above */
+void mem_usage(size_t *currentp, size_t *peakp);
+
 /** Time measurement.  **/
 
 /* Time counted as fp number in seconds */
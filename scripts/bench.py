@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+
+
+# Benchmark driver: sweep queue sizes, string lengths and operations through
+# qtest, and emit one CSV row per point.  The measurements come from the
+# per-command profile of qtest ("option profile 1" and "stats json"), so they
+# cover the whole command as qtest runs it, checks included.
+class Bench:
+
+    qtest = "./qtest"
+    verbose = False
+    # Seconds a point may take before it and the larger sizes are skipped
+    timeout = 300
+
+    sizes = [1000, 10000, 100000, 1000000, 10000000]
+
+    # Length range of the random strings, passed as rand_min and rand_max.
+    # Strings of the short range fit in the element, the long ones do not.
+    distDict = {
+        "short": (5, 9),
+        "long": (32, 64)
+    }
+
+    # Operation: (setup, measured command, profile name, calls, whether each
+    # call works on all n elements of the queue or just one)
+    opDict = {
+        "insert": ([], "ih RAND %(n)d", "ih", 1, True),
+        "remove": (["ih %(fixed)s %(n)d"], "rh %(fixed)s %(n)d", "rh", 1,
+                   True),
+        "reverse": (["ih RAND %(n)d"], "reverse", "reverse", 1, True),
+        "sort": (["ih RAND %(n)d"], "sort", "sort", 1, True),
+        "dedup": (["ih RAND %(n)d", "sort"], "dedup", "dedup", 1, True),
+        "swap": (["ih RAND %(n)d"], "swap", "swap", 1, True),
+        "delete_mid": (["ih RAND %(n)d"], "dm", "dm", 1000, False),
+        "shuffle": (["ih RAND %(n)d"], "shuffle", "shuffle", 1, True)
+    }
+
+    opList = ["insert", "remove", "reverse", "sort", "dedup", "swap",
+              "delete_mid", "shuffle"]
+
+    columns = ["op", "size", "strings", "ops", "ns_per_op", "p99_ns",
+               "allocs_per_op", "bytes_per_op", "peak_rss_kb"]
+
+    def __init__(self, qtest="", options=[], verbose=False, timeout=None,
+                 blocks=False):
+        if qtest != "":
+            self.qtest = qtest
+        # Run every command on the block deque of the bq command instead
+        self.blocks = blocks
+        if timeout is not None:
+            self.timeout = timeout
+        self.options = options
+        self.verbose = verbose
+
+    def log(self, text):
+        if self.verbose:
+            print(text, file=sys.stderr)
+
+    def script(self, op, n, dist):
+        setup, cmd, name, calls, _ = self.opDict[op]
+        lo, hi = self.distDict[dist]
+        args = {"n": n, "fixed": "x" * hi}
+        lines = ["option time_limit 0",
+                 "option rand_min %d" % lo,
+                 "option rand_max %d" % hi]
+        lines += ["option %s %s" % kv for kv in self.options]
+        queue = ["new"] + [s % args for s in setup]
+        measured = [cmd % args] * min(calls, n)
+        if self.blocks:
+            queue = ["bq " + s for s in queue]
+            measured = ["bq " + s for s in measured]
+            name = "bq"
+        lines += queue
+        lines.append("option profile 1")
+        lines += measured
+        lines += ["option profile 0", "stats json", "bq free" if self.blocks
+                  else "free", "quit"]
+        return name, "\n".join(lines) + "\n"
+
+    # Run qtest on a script and return its output, its peak RSS in KiB and
+    # whether it was killed for running out of time
+    def runScript(self, text):
+        with tempfile.NamedTemporaryFile("w", suffix=".cmd") as f:
+            f.write(text)
+            f.flush()
+            p = subprocess.Popen([self.qtest, "-v", "1", "-f", f.name],
+                                 stdout=subprocess.PIPE,
+                                 stderr=subprocess.STDOUT)
+            timer = None
+            if self.timeout > 0:
+                timer = threading.Timer(self.timeout, p.kill)
+                timer.start()
+            out = p.stdout.read().decode("utf-8", "replace")
+            _, status, usage = os.wait4(p.pid, 0)
+            if timer:
+                timer.cancel()
+        killed = os.WIFSIGNALED(status) and os.WTERMSIG(status) == 9
+        return out, usage.ru_maxrss, killed
+
+    def parseStats(self, out, name):
+        start = out.find('{"commands": [')
+        if start < 0:
+            return None
+        end = out.find("}\n", out.find('"interp_bytes"', start))
+        try:
+            stats = json.loads(out[start:end + 1])
+        except ValueError:
+            return None
+        for c in stats["commands"]:
+            if c["name"] == name:
+                return c
+        return None
+
+    def measure(self, op, n, dist):
+        name, text = self.script(op, n, dist)
+        self.log("+++ %s size %d strings %s" % (op, n, dist))
+        out, rss, killed = self.runScript(text)
+        if killed:
+            print("WARNING: %s at size %d (%s) took over %d seconds" %
+                  (op, n, dist, self.timeout), file=sys.stderr)
+            return False
+        c = self.parseStats(out, name)
+        if c is None:
+            print("WARNING: no profile of %s for %s at size %d (%s)" %
+                  (name, op, n, dist), file=sys.stderr)
+            self.log(out)
+            return None
+        per_call = n if self.opDict[op][4] else 1
+        ops = c["calls"] * per_call
+        return [op, n, dist, ops,
+                "%.2f" % (c["total_ns"] / float(ops)),
+                c["p99_ns"],
+                "%.4f" % (c["mallocs"] / float(ops)),
+                "%.2f" % (c["malloc_bytes"] / float(ops)),
+                rss]
+
+    def run(self, ops, sizes, dists, outfile):
+        print(",".join(self.columns), file=outfile)
+        outfile.flush()
+        for op in ops:
+            for dist in dists:
+                for n in sizes:
+                    row = self.measure(op, n, dist)
+                    if row is False:
+                        break
+                    if row is None:
+                        continue
+                    print(",".join(str(v) for v in row), file=outfile)
+                    outfile.flush()
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-s SIZES] [-d DISTS] [-O OPS] "
+          "[-o FILE] [-x NAME=VAL] [-T SECONDS] [-b] [-v]" % name)
+    print("  -h          Print this message")
+    print("  -p PROG     Program to benchmark")
+    print("  -s SIZES    Comma-separated queue sizes (default: %s)" %
+          ",".join(str(n) for n in Bench.sizes))
+    print("  -d DISTS    String lengths among %s (default: all)" %
+          ",".join(sorted(Bench.distDict.keys())))
+    print("  -O OPS      Operations among %s (default: all)" %
+          ",".join(Bench.opList))
+    print("  -o FILE     Write the CSV to FILE instead of standard output")
+    print("  -x NAME=VAL Set qtest option NAME to VAL, e.g. sort_algo=1")
+    print("  -T SECONDS  Time allowed per point, 0 for none (default: %d)" %
+          Bench.timeout)
+    print("  -b          Benchmark the block deque of the bq command")
+    print("  -v          Report progress on standard error")
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = ""
+    sizes = Bench.sizes
+    dists = sorted(Bench.distDict.keys())
+    ops = Bench.opList
+    outname = ""
+    options = []
+    verbose = False
+    timeout = None
+    blocks = False
+
+    optlist, args = getopt.getopt(args, 'hp:s:d:O:o:x:T:bv')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-s':
+            sizes = [int(float(v)) for v in val.split(",")]
+        elif opt == '-d':
+            dists = val.split(",")
+        elif opt == '-O':
+            ops = val.split(",")
+        elif opt == '-o':
+            outname = val
+        elif opt == '-x':
+            if "=" not in val:
+                usage(name)
+            options.append(tuple(val.split("=", 1)))
+        elif opt == '-T':
+            timeout = int(val)
+        elif opt == '-b':
+            blocks = True
+        elif opt == '-v':
+            verbose = True
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    for d in dists:
+        if d not in Bench.distDict:
+            print("Unknown string lengths '%s'" % d)
+            usage(name)
+    for op in ops:
+        if op not in Bench.opDict:
+            print("Unknown operation '%s'" % op)
+            usage(name)
+    b = Bench(qtest=prog, options=options, verbose=verbose, timeout=timeout,
+              blocks=blocks)
+    if outname:
+        with open(outname, "w") as f:
+            b.run(ops, sizes, dists, f)
+    else:
+        b.run(ops, sizes, dists, sys.stdout)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
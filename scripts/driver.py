@@ -35,7 +35,16 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-perf",
+        19: "trace-19-perf",
+        20: "trace-20-perf",
+        21: "trace-21-ops",
+        22: "trace-22-perf",
+        23: "trace-23-ops",
+        24: "trace-24-perf",
+        25: "trace-25-ops",
+        26: "trace-26-complexity"
     }
 
     traceProbs = {
@@ -55,10 +64,19 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 5]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import selectors
+import socket
+import sys
+import time
+
+
+# Load generator for the command server of qtest (qtest -s PORT or -u PATH).
+# Each client opens a session, creates a queue and then keeps up to a window
+# of commands in flight, cycling through the workload.  Latency is taken from
+# sending a command to reading the +OK or -ERR line that ends its response.
+class Client:
+
+    def __init__(self, sock, commands, count, window):
+        self.sock = sock
+        self.commands = commands
+        # The session starts with a queue of its own
+        self.total = count + 1
+        self.window = window
+        self.sent = 0
+        self.done = 0
+        self.errors = 0
+        self.inflight = []
+        self.inbuf = b""
+        self.outbuf = b""
+        self.latencies = []
+        self.mask = selectors.EVENT_READ
+
+    def fill(self):
+        now = time.monotonic()
+        while self.sent < self.total and len(self.inflight) < self.window:
+            cmd = "new" if self.sent == 0 else \
+                self.commands[(self.sent - 1) % len(self.commands)]
+            self.outbuf += (cmd + "\n").encode()
+            self.inflight.append(now)
+            self.sent += 1
+
+    def received(self, data):
+        self.inbuf += data
+        now = time.monotonic()
+        lines = self.inbuf.split(b"\n")
+        self.inbuf = lines.pop()
+        for line in lines:
+            if line not in (b"+OK", b"-ERR"):
+                continue
+            if line == b"-ERR":
+                self.errors += 1
+            self.latencies.append(now - self.inflight.pop(0))
+            self.done += 1
+
+
+class LoadGen:
+
+    clients = 8
+    count = 10000
+    window = 16
+
+    # Commands cycled through by every client after "new"; the queue stays
+    # short, so each command costs about the same.  Run the server at a low
+    # verbosity, such as -v 1, or the queue is shown after every command.
+    workload = ["it RAND 1", "ih RAND 1", "size", "rh", "rt"]
+
+    def __init__(self, address, clients=None, count=None, window=None,
+                 workload=None):
+        self.address = address
+        if clients is not None:
+            self.clients = clients
+        if count is not None:
+            self.count = count
+        if window is not None:
+            self.window = window
+        if workload:
+            self.workload = workload
+
+    def connect(self):
+        if ":" in self.address:
+            host, port = self.address.rsplit(":", 1)
+            sock = socket.create_connection((host or "localhost", int(port)))
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        else:
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(self.address)
+        sock.setblocking(False)
+        return sock
+
+    def run(self):
+        sel = selectors.DefaultSelector()
+        clients = []
+        for _ in range(self.clients):
+            c = Client(self.connect(), self.workload, self.count, self.window)
+            clients.append(c)
+            sel.register(c.sock, selectors.EVENT_READ, c)
+
+        start = time.monotonic()
+        active = list(clients)
+        for c in clients:
+            c.fill()
+        while active:
+            for c in active:
+                mask = selectors.EVENT_READ
+                if c.outbuf:
+                    mask |= selectors.EVENT_WRITE
+                if mask != c.mask:
+                    sel.modify(c.sock, mask, c)
+                    c.mask = mask
+            for key, mask in sel.select():
+                c = key.data
+                if mask & selectors.EVENT_WRITE:
+                    n = c.sock.send(c.outbuf)
+                    c.outbuf = c.outbuf[n:]
+                if mask & selectors.EVENT_READ:
+                    data = c.sock.recv(65536)
+                    if not data:
+                        print("ERROR: server closed a session",
+                              file=sys.stderr)
+                        return False
+                    c.received(data)
+                    if c.done == c.total:
+                        sel.unregister(c.sock)
+                        c.sock.close()
+                        active.remove(c)
+                    else:
+                        c.fill()
+        elapsed = time.monotonic() - start
+        self.report(clients, elapsed)
+        return True
+
+    def report(self, clients, elapsed):
+        lat = sorted(x for c in clients for x in c.latencies)
+        errors = sum(c.errors for c in clients)
+
+        def quantile(q):
+            return lat[min(len(lat) - 1, int(q * len(lat)))] * 1e6
+
+        print("clients,window,commands,errors,seconds,commands_per_s,"
+              "p50_us,p90_us,p99_us,p999_us,max_us")
+        print("%d,%d,%d,%d,%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f" %
+              (len(clients), self.window, len(lat), errors, elapsed,
+               len(lat) / elapsed, quantile(0.5), quantile(0.9),
+               quantile(0.99), quantile(0.999), lat[-1] * 1e6))
+
+
+def usage(name):
+    print("Usage: %s [-h] [-c CLIENTS] [-n COUNT] [-w WINDOW] [-f FILE] "
+          "ADDRESS" % name)
+    print("  -h          Print this message")
+    print("  -c CLIENTS  Number of sessions (default: %d)" % LoadGen.clients)
+    print("  -n COUNT    Commands sent by each session (default: %d)" %
+          LoadGen.count)
+    print("  -w WINDOW   Commands each session keeps in flight (default: %d)"
+          % LoadGen.window)
+    print("  -f FILE     Cycle through the commands of FILE instead of: %s" %
+          "; ".join(LoadGen.workload))
+    print("  ADDRESS     HOST:PORT or :PORT for TCP, else a Unix socket path")
+    sys.exit(0)
+
+
+def run(name, args):
+    clients = None
+    count = None
+    window = None
+    workload = None
+
+    optlist, args = getopt.getopt(args, 'hc:n:w:f:')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-c':
+            clients = int(val)
+        elif opt == '-n':
+            count = int(val)
+        elif opt == '-w':
+            window = int(val)
+        elif opt == '-f':
+            with open(val) as f:
+                workload = [l.strip() for l in f
+                            if l.strip() and not l.startswith("#")]
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    if len(args) != 1:
+        usage(name)
+    g = LoadGen(args[0], clients=clients, count=count, window=window,
+                workload=workload)
+    sys.exit(0 if g.run() else 1)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# Smoke test for the command server of qtest.  A server is started on a Unix
+# socket, a batch of commands is sent in one go, and the +OK and -ERR lines
+# ending the responses must come back in the order the commands were sent.
+class ServerTest:
+
+    qtest = "./qtest"
+    verbose = False
+
+    # Each command with whether it succeeds; SNAP is replaced by a file path
+    session = [
+        ("new", True),
+        ("it a", True),
+        ("it b", True),
+        ("size", True),
+        ("bogus", False),
+        ("rh a", True),
+        # Files of the server are out of reach unless it runs with -F
+        ("save SNAP", False),
+        ("time save SNAP", False),
+        ("log SNAP", False),
+        ("source SNAP", False),
+        ("rh z", False),
+        ("rh a", False),
+        ("free", True),
+    ]
+
+    # The same with -F, which lets sessions open files
+    files_session = [
+        ("new", True),
+        ("it a", True),
+        ("save SNAP", True),
+        ("rh a", True),
+        ("load SNAP", True),
+        ("rh a", True),
+        # Still acting on the whole program
+        ("source SNAP", False),
+        ("free", True),
+    ]
+
+    def __init__(self, qtest=None, verbose=None):
+        if qtest is not None:
+            self.qtest = qtest
+        if verbose is not None:
+            self.verbose = verbose
+
+    def serve(self, path, args):
+        clist = [self.qtest, "-v", "1", "-u", path] + args
+        proc = subprocess.Popen(clist, stdout=subprocess.DEVNULL)
+        for _ in range(100):
+            if os.path.exists(path):
+                return proc
+            time.sleep(0.05)
+        proc.kill()
+        proc.wait()
+        return None
+
+    def talk(self, path, lines):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(10)
+        sock.connect(path)
+        # Everything at once, so the commands are pipelined
+        sock.sendall("".join(l + "\n" for l in lines).encode())
+        sock.shutdown(socket.SHUT_WR)
+        data = b""
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        sock.close()
+        return data.decode(errors="replace")
+
+    def run_session(self, name, session, args):
+        tmp = tempfile.mkdtemp(prefix="qtest-server.")
+        path = os.path.join(tmp, "sock")
+        snap = os.path.join(tmp, "snap")
+        proc = self.serve(path, args)
+        if proc is None:
+            print("ERROR: %s: server did not start" % name)
+            return False
+        try:
+            output = self.talk(path,
+                               [c.replace("SNAP", snap) for c, _ in session])
+        except OSError as e:
+            print("ERROR: %s: %s" % (name, e))
+            output = None
+        proc.terminate()
+        proc.wait()
+
+        ok = output is not None
+        if ok:
+            if self.verbose:
+                print(output, end="")
+            status = [l for l in output.split("\n") if l in ("+OK", "-ERR")]
+            expect = ["+OK" if s else "-ERR" for _, s in session]
+            if status != expect:
+                print("ERROR: %s: got %s, expected %s" %
+                      (name, " ".join(status), " ".join(expect)))
+                ok = False
+        if "-F" not in args and os.path.exists(snap):
+            print("ERROR: %s: a session wrote %s" % (name, snap))
+            ok = False
+        for f in (snap, path):
+            if os.path.exists(f):
+                os.remove(f)
+        os.rmdir(tmp)
+        print("---\t%s\t%s" % (name, "ok" if ok else "FAILED"))
+        return ok
+
+    def run(self):
+        ok = self.run_session("server-pipeline", self.session, [])
+        ok = self.run_session("server-files", self.files_session,
+                              ["-F"]) and ok
+        return ok
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-v]" % name)
+    print("  -h        Print this message")
+    print("  -p PROG   Program to test")
+    print("  -v        Show the responses of the server")
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = None
+    verbose = None
+
+    optlist, args = getopt.getopt(args, 'hp:v')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-v':
+            verbose = True
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    t = ServerTest(qtest=prog, verbose=verbose)
+    sys.exit(0 if t.run() else 1)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
@@ -0,0 +1,484 @@
+/* Command server driven by epoll, see server.h */
+
+/* For accept4() */
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "list.h"
+#include "report.h"
+
+/* Bytes asked of read() at a time */
+#define SERVER_READ_SIZE 65536
+
+/* Longest command line a client may send */
+#define SERVER_MAX_LINE 65536
+
+/* Output a session may have pending before the rest of its input waits */
+#define SERVER_MAX_PENDING (4 << 20)
+
+/* Chunks of output handed to a single writev() */
+#define SERVER_IOV 64
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_LISTEN 8
+
+/* Anything registered with epoll starts with this */
+struct endpoint {
+    int fd;
+    bool listening;
+};
+
+/* Output of a batch of commands, as left by open_memstream() */
+struct out_chunk {
+    struct out_chunk *next;
+    char *data;
+    size_t len;
+};
+
+struct session {
+    struct endpoint ep;
+    struct list_head link;
+    void *state;
+    /* Input not consumed yet; one byte is always left spare */
+    char *in;
+    size_t in_len, in_cap;
+    /* Output waiting to be written, oldest first */
+    struct out_chunk *out, **out_tail;
+    size_t out_off; /* Bytes of the first chunk written already */
+    size_t pending; /* Bytes of all chunks left to write */
+    uint32_t events;
+    bool eof;     /* The client will send nothing more */
+    bool closing; /* Close once the pending output is written */
+};
+
+static int epfd = -1;
+static const session_ops_t *ops;
+static LIST_HEAD(sessions);
+static struct endpoint listeners[SERVER_MAX_LISTEN];
+static int nlisteners = 0;
+
+static volatile sig_atomic_t stop_flag = false;
+
+static void stop_handler(int sig)
+{
+    stop_flag = true;
+}
+
+static bool add_listener(int fd)
+{
+    if (nlisteners == SERVER_MAX_LISTEN || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return false;
+    }
+    struct endpoint *ep = &listeners[nlisteners];
+    ep->fd = fd;
+    ep->listening = true;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ep};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return false;
+    }
+    nlisteners++;
+    return true;
+}
+
+/*
+ * Listen on [HOST:]PORT, IPv4 and IPv6 alike.  Without a host that is the
+ * loopback addresses, and a host of "*" or "" stands for all of them.
+ */
+static bool listen_tcp(const char *addr)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    char host[256];
+    const char *node = NULL;
+    const char *port = addr;
+    const char *colon = strrchr(addr, ':');
+    if (colon) {
+        const char *name = addr;
+        size_t len = colon - addr;
+        /* Brackets around an IPv6 address, as in [::1]:PORT */
+        if (len >= 2 && name[0] == '[' && name[len - 1] == ']') {
+            name++;
+            len -= 2;
+        }
+        if (len >= sizeof(host)) {
+            report(1, "ERROR: Host name too long in %s", addr);
+            return false;
+        }
+        memcpy(host, name, len);
+        host[len] = '\0';
+        port = colon + 1;
+        if (len == 0 || strcmp(host, "*") == 0)
+            hints.ai_flags = AI_PASSIVE;
+        else
+            node = host;
+    }
+    struct addrinfo *res;
+    int err = getaddrinfo(node, port, &hints, &res);
+    if (err) {
+        report(1, "ERROR: Cannot resolve %s:%s: %s", node ? node : "*", port,
+               gai_strerror(err));
+        return false;
+    }
+
+    bool ok = false;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family,
+                        ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (ai->ai_family == AF_INET6)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            continue;
+        }
+        ok = add_listener(fd) || ok;
+    }
+    freeaddrinfo(res);
+    if (!ok)
+        report(1, "ERROR: Cannot listen on port %s", port);
+    return ok;
+}
+
+static bool listen_unix(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        report(1, "ERROR: Socket path %s is too long", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        report(1, "ERROR: Cannot create socket: %s", strerror(errno));
+        return false;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        report(1, "ERROR: Cannot bind %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (!add_listener(fd)) {
+        report(1, "ERROR: Cannot listen on %s", path);
+        unlink(path);
+        return false;
+    }
+    return true;
+}
+
+/* Watch for input unless output piles up, and for room to write output */
+static void session_watch(struct session *s)
+{
+    uint32_t events = 0;
+    if (!s->eof && !s->closing && s->pending < SERVER_MAX_PENDING)
+        events |= EPOLLIN;
+    if (s->pending > 0)
+        events |= EPOLLOUT;
+    if (events == s->events)
+        return;
+    struct epoll_event ev = {.events = events, .data.ptr = &s->ep};
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, s->ep.fd, &ev) == 0)
+        s->events = events;
+}
+
+static void accept_clients(struct endpoint *ep)
+{
+    for (;;) {
+        int fd = accept4(ep->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                report(1, "ERROR: Cannot accept client: %s", strerror(errno));
+            return;
+        }
+        /* Responses are small and latency matters more than segment count */
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        struct session *s = calloc(1, sizeof(struct session));
+        void *state = s ? ops->open() : NULL;
+        if (!state) {
+            report(1, "ERROR: Could not allocate space for new session");
+            free(s);
+            close(fd);
+            continue;
+        }
+        s->ep.fd = fd;
+        s->ep.listening = false;
+        s->state = state;
+        s->out_tail = &s->out;
+        s->events = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &s->ep};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            ops->enter(state);
+            ops->close(state);
+            free(s);
+            close(fd);
+            continue;
+        }
+        list_add_tail(&s->link, &sessions);
+    }
+}
+
+static void session_close(struct session *s)
+{
+    ops->enter(s->state);
+    ops->close(s->state);
+    while (s->out) {
+        struct out_chunk *c = s->out;
+        s->out = c->next;
+        free(c->data);
+        free(c);
+    }
+    free(s->in);
+    close(s->ep.fd);
+    list_del(&s->link);
+    free(s);
+}
+
+/* Read what the client sent; return false if the session must end now */
+static bool session_read(struct session *s)
+{
+    if (s->in_cap < s->in_len + SERVER_READ_SIZE + 1) {
+        size_t cap = s->in_len + SERVER_READ_SIZE + 1;
+        char *in = realloc(s->in, cap);
+        if (!in)
+            return false;
+        s->in = in;
+        s->in_cap = cap;
+    }
+    ssize_t n = read(s->ep.fd, s->in + s->in_len, SERVER_READ_SIZE);
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+    if (n == 0)
+        s->eof = true;
+    s->in_len += n;
+    return true;
+}
+
+/* Whether the command line is quit, which ends the session */
+static bool is_quit(const char *line)
+{
+    line += strspn(line, " \t");
+    return strncmp(line, "quit", 4) == 0 &&
+           (line[4] == '\0' || line[4] == ' ' || line[4] == '\t');
+}
+
+/*
+ * Run the complete command lines received so far, and the last one once the
+ * client is done sending, as long as the output stays within bounds.  The
+ * output of the whole batch is captured into one chunk.
+ * Return false if the session must end now.
+ */
+static bool session_run(struct session *s)
+{
+    char *p = s->in, *end = s->in + s->in_len;
+    if (s->closing || s->pending >= SERVER_MAX_PENDING || p == end ||
+        (!s->eof && !memchr(p, '\n', end - p)))
+        goto done;
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem)
+        return false;
+    set_report_file(mem);
+    ops->enter(s->state);
+    while (s->pending + len < SERVER_MAX_PENDING && !s->closing) {
+        char *nl = memchr(p, '\n', end - p);
+        if (!nl) {
+            if (!s->eof || p == end)
+                break;
+            /* The spare byte past the input holds the terminator */
+            nl = end;
+        }
+        *nl = '\0';
+        if (nl > p && nl[-1] == '\r')
+            nl[-1] = '\0';
+        bool ok = true;
+        if (is_quit(p))
+            s->closing = true;
+        else
+            ok = interpret_session_cmd(p);
+        fputs(ok ? "+OK\n" : "-ERR\n", mem);
+        fflush(mem);
+        p = nl < end ? nl + 1 : end;
+    }
+    ops->leave(s->state);
+    set_report_file(NULL);
+    fclose(mem);
+
+    if (len > 0) {
+        struct out_chunk *c = malloc(sizeof(struct out_chunk));
+        if (!c) {
+            free(buf);
+            return false;
+        }
+        c->next = NULL;
+        c->data = buf;
+        c->len = len;
+        *s->out_tail = c;
+        s->out_tail = &c->next;
+        s->pending += len;
+    } else {
+        free(buf);
+    }
+    s->in_len = end - p;
+    memmove(s->in, p, s->in_len);
+
+done:
+    if (s->in_len >= SERVER_MAX_LINE && !memchr(s->in, '\n', s->in_len)) {
+        report(1, "ERROR: Client sent a line of over %d bytes",
+               SERVER_MAX_LINE);
+        return false;
+    }
+    if (s->eof && s->in_len == 0)
+        s->closing = true;
+    return true;
+}
+
+/* Write as much pending output as the socket takes */
+static bool session_flush(struct session *s)
+{
+    while (s->out) {
+        struct iovec iov[SERVER_IOV];
+        int n = 0;
+        for (struct out_chunk *c = s->out; c && n < SERVER_IOV;
+             c = c->next, n++) {
+            size_t off = n == 0 ? s->out_off : 0;
+            iov[n].iov_base = c->data + off;
+            iov[n].iov_len = c->len - off;
+        }
+        ssize_t w = writev(s->ep.fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        s->pending -= w;
+        while (w > 0) {
+            struct out_chunk *c = s->out;
+            size_t left = c->len - s->out_off;
+            if ((size_t) w < left) {
+                s->out_off += w;
+                break;
+            }
+            w -= left;
+            s->out = c->next;
+            s->out_off = 0;
+            free(c->data);
+            free(c);
+        }
+        if (!s->out)
+            s->out_tail = &s->out;
+    }
+    return true;
+}
+
+static void session_event(struct session *s, uint32_t events)
+{
+    bool ok = !(events & EPOLLERR);
+    if (ok && (events & EPOLLOUT))
+        ok = session_flush(s);
+    if (ok && (events & (EPOLLIN | EPOLLHUP)) && !s->eof && !s->closing)
+        ok = session_read(s);
+    ok = ok && session_run(s) && session_flush(s);
+    if (!ok || (s->closing && s->pending == 0)) {
+        session_close(s);
+        return;
+    }
+    session_watch(s);
+}
+
+bool run_server(const char *tcp_addr,
+                const char *unix_path,
+                const session_ops_t *session_ops)
+{
+    ops = session_ops;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        report(1, "ERROR: Cannot create epoll instance: %s", strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    if (tcp_addr)
+        ok = listen_tcp(tcp_addr) && ok;
+    if (unix_path)
+        ok = listen_unix(unix_path) && ok;
+
+    /* Without SA_RESTART, epoll_wait() returns when asked to stop */
+    struct sigaction sa = {.sa_handler = stop_handler}, old_int, old_term,
+                     old_pipe;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, &old_pipe);
+
+    if (ok) {
+        report(1, "Serving commands on%s%s%s%s", tcp_addr ? " address " : "",
+               tcp_addr ? tcp_addr : "", unix_path ? " socket " : "",
+               unix_path ? unix_path : "");
+    }
+    stop_flag = false;
+    while (ok && !stop_flag) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int n = epoll_wait(epfd, events, SERVER_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            report(1, "ERROR: epoll_wait failed: %s", strerror(errno));
+            ok = false;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct endpoint *ep = events[i].data.ptr;
+            if (ep->listening)
+                accept_clients(ep);
+            else
+                session_event(container_of(ep, struct session, ep),
+                              events[i].events);
+        }
+    }
+
+    while (!list_empty(&sessions))
+        session_close(list_first_entry(&sessions, struct session, link));
+    for (int i = 0; i < nlisteners; i++)
+        close(listeners[i].fd);
+    nlisteners = 0;
+    if (unix_path)
+        unlink(unix_path);
+    close(epfd);
+    epfd = -1;
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    return ok;
+}
@@ -0,0 +1,45 @@
+#ifndef LAB0_SERVER_H
+#define LAB0_SERVER_H
+
+/*
+ * Command server.
+ *
+ * Clients connect over TCP or a Unix socket and send command lines, which
+ * are run one after the other by the interpreter of console.h.  Every
+ * connection is a session with state of its own, such as its queues, which
+ * the hooks below swap in before its commands run and out afterwards.
+ * A client may send any number of commands without waiting: the output of
+ * each command is followed by a line reading "+OK" if it succeeded or "-ERR"
+ * if not, and the responses go out in order.  Sending quit, or closing the
+ * connection, ends the session.
+ *
+ * Everything runs on a single thread driven by epoll, so commands of
+ * different sessions never overlap and options stay shared by all of them.
+ */
+
+#include <stdbool.h>
+
+typedef struct {
+    /* Create the state of a new session; return NULL if that failed */
+    void *(*open)(void);
+    /* Make state the one commands act on */
+    void (*enter)(void *state);
+    /* Put the current state aside until its session runs again */
+    void (*leave)(void *state);
+    /* Release the state of a session that ended, after entering it */
+    void (*close)(void *state);
+} session_ops_t;
+
+/*
+ * Serve clients on TCP address tcp_addr and on the Unix socket at unix_path,
+ * either of which may be NULL, until SIGINT or SIGTERM.  The TCP address
+ * reads [HOST:]PORT: leaving out the host listens on loopback only, as
+ * sessions are not authenticated, and a host of "*" on every address.  Any
+ * file at unix_path is replaced, and removed on return.
+ * Return false if no socket could be set up.
+ */
+bool run_server(const char *tcp_addr,
+                const char *unix_path,
+                const session_ops_t *ops);
+
+#endif /* LAB0_SERVER_H */
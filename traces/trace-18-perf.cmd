@@ -0,0 +1,102 @@
+# Test performance of merge with 32 sorted queues of 25000 elements
+option fail 0
+option malloc 0
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+new
+ih RAND 25000
+sort
+merge
+size
+free
@@ -0,0 +1,9 @@
+# Test performance of reverseK with small and large groups
+option fail 0
+option malloc 0
+new
+ih RAND 1000000
+reverseK 3
+reverseK 1000
+reverse
+reverseK 999999
@@ -0,0 +1,10 @@
+# Test performance of swapK with small and large groups
+option fail 0
+option malloc 0
+new
+ih RAND 1000000
+swapK 1
+swapK 3
+reverse
+swapK 1000
+swapK 250000
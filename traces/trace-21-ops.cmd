@@ -0,0 +1,69 @@
+# Test of rhz, which takes over removed strings without copying them, and
+# of dm on queues of even size read either way, and of dedup_unsorted
+# when its hash table cannot be allocated, and of merge into a queue that
+# was reversed and emptied
+option fail 0
+option malloc 0
+new
+ih gerbil
+ih a_string_too_long_to_fit_in_the_element
+it bear
+reverse
+rhz bear
+rhz gerbil
+it dolphin
+rhz a_string_too_long_to_fit_in_the_element
+rhz dolphin
+option pool 1
+new
+ih meerkat
+it another_string_too_long_to_fit_inline
+rhz meerkat
+rhz another_string_too_long_to_fit_inline
+free
+free
+option pool 0
+new
+it a
+it b
+it c
+it d
+it e
+it f
+dm
+reverse
+dm
+dm
+reverse
+rh a
+rh b
+rh f
+free
+option dedup_unsorted 1
+new
+it b
+it a
+it c
+it a
+it d
+it b
+option malloc 100
+dedup
+option malloc 0
+rh c
+rh d
+free
+new
+ih x
+reverse
+rh x
+new
+it a
+it b
+it c
+prev
+merge
+rh a
+rh b
+rh c
+free
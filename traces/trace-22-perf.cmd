@@ -0,0 +1,12 @@
+# Test performance of external sort, spilling runs of 256 KiB to disk
+option fail 0
+option malloc 0
+option spill_kb 256
+new
+ih RAND 200000
+sort
+size
+reverse
+sortout
+size
+free
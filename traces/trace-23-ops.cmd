@@ -0,0 +1,34 @@
+# Test of save and load, with strings inside and outside their elements
+option fail 0
+option malloc 0
+new
+ih gerbil
+ih bear
+it a_string_long_enough_to_live_outside_the_element
+it dolphin
+reverse
+save /tmp/lab0-trace-23.q
+free
+new
+it zebra
+load /tmp/lab0-trace-23.q
+load /tmp/lab0-trace-23.q
+size
+rh zebra
+rhz dolphin
+rhz a_string_long_enough_to_live_outside_the_element
+rh gerbil
+sort
+dedup
+rhz a_string_long_enough_to_live_outside_the_element
+rh dolphin
+rh gerbil
+size
+ih RAND 100000
+save /tmp/lab0-trace-23.q
+free
+new
+load /tmp/lab0-trace-23.q
+size
+sort
+free
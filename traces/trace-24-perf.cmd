@@ -0,0 +1,16 @@
+# Test performance of a million elements with fast allocation checks
+option fail 0
+option malloc 0
+option harness 1
+new
+ih RAND 1000000
+option harness 0
+it dolphin 1000
+swap
+option harness 1
+reverse
+rh dolphin
+dm
+size
+free
+option harness 0
@@ -0,0 +1,17 @@
+# Test of record and replay, with a command run by time
+option fail 0
+option malloc 0
+new
+record /tmp/lab0-trace-25.trace
+it a
+time it b
+time
+ih c
+record
+free
+new
+replay /tmp/lab0-trace-25.trace
+rt b
+rt a
+rh c
+free
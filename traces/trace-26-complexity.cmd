@@ -0,0 +1,9 @@
+# Test if time complexity of q_size, q_delete_mid and the bulk variants of q_insert_tail, q_insert_head, q_remove_tail and q_remove_head is constant
+option simulation 1
+size
+dm
+it 16
+ih 16
+rh 16
+rt 16
+option simulation 0